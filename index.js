@@ -52,6 +52,8 @@ app.post('/result',function(req,res){
     //var process = spawn('python',["/home/shubham/Desktop/svg_visualization/obj-to-svg/main.py", arg1]);
   var options = { cwd: '/home/shubham/Desktop/svg_visualization/obj-to-svg/' };
   var commn='./poly '+filenm+' '+rotationx+' '+rotationy+' '+rotationz;
+  // the viewpoint is not passed on: the poly binary kept here predates --vx/--vy/--vz
+  // and rejects them, so rebuild it from poly.cpp (see readme.txt) before sending them
   var commannds=[commn];
   nrc.run(commannds,options);
 
@@ -1,11 +1,19 @@
 // #define WINDOWS  /* uncomment this line to use it for windows.*/
+// #define SINGLE_PRECISION  /* uncomment this line to store and render vertices in float.*/
+// #define SVGZ  /* uncomment this line to write gzipped .svgz files with --svgz; link with -lz.*/
 #ifdef WINDOWS
 #include <direct.h>
+#include <process.h>
 #define GetCurrentDir _getcwd
+#define getpid _getpid
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #define GetCurrentDir getcwd
 #endif
+#include <sys/stat.h>
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -13,19 +21,49 @@
 #include <iterator>
 #include <map>
 #include <vector>
+#include <queue>
 #include <fstream>
 #include <math.h>
 #include <array>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <thread>
+#include <atomic>
 #include "Eigen/Dense"
+#ifdef SVGZ
+#include <zlib.h>
+#endif
 
 #define PI 3.14159265358979323846
 
 using namespace Eigen;
 using namespace std;
 
-unsigned IMG_WIDTH = 10000;
-unsigned IMG_HEIGHT = 10000;
+/* Scalar type of the vertex storage and the render core. Materials, lights
+   and the view matrix stay in double and are narrowed where they meet the
+   vertices. */
+#ifdef SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+/* Vertex positions as a 3xN structure of arrays: row k holds coordinate k
+   of every vertex, so the transform kernels stream through contiguous x, y
+   and z arrays with Eigen's packet math. */
+template<typename Scalar> using Vertex_Array = Matrix<Scalar,3,Dynamic,RowMajor>;
+template<typename Scalar> using Vec3 = Matrix<Scalar,3,1>;
+typedef Vertex_Array<Real> Vertex_Matrix;
+
+/* Size of the image being written. Every thread renders its own view in
+   batch mode, so each keeps its own copy. */
+thread_local unsigned IMG_WIDTH = 10000;
+thread_local unsigned IMG_HEIGHT = 10000;
 const string PARALLEL = "parallel";
+const string PERSPECTIVE = "perspective";
 
 class Light{
 private:
@@ -42,7 +80,7 @@ public:
 		specular = Vector3d(0.5,0.5,0.5);
 	}
 
-	Vector3d get_position(){
+	Vector3d get_position() const{
 		return position;
 	}
 
@@ -50,7 +88,7 @@ public:
 		this->position = position;
 	}
 
-	Vector3d get_ambient(){
+	Vector3d get_ambient() const{
 		return ambient;
 	}
 
@@ -58,7 +96,7 @@ public:
 		this->ambient = ambient;
 	}
 
-	Vector3d get_diffuse(){
+	Vector3d get_diffuse() const{
 		return diffuse;
 	}
 
@@ -66,7 +104,7 @@ public:
 		this->diffuse = diffuse;
 	}
 
-	Vector3d get_specular(){
+	Vector3d get_specular() const{
 		return specular;
 	}
 
@@ -107,7 +145,7 @@ public:
 		this-> illum_no = illum_no;
 	}
 
-	string get_name(){
+	const string& get_name() const{
 		return this->name;
 	}
 
@@ -115,7 +153,7 @@ public:
 		this->name = name;
 	}
 
-	Vector3d get_ambient(){
+	Vector3d get_ambient() const{
 		return this->ambient;
 	}
 
@@ -123,7 +161,7 @@ public:
 		this->ambient = ambient;
 	}
 
-	Vector3d get_diffuse(){
+	Vector3d get_diffuse() const{
 		return this->diffuse;
 	}
 
@@ -131,7 +169,7 @@ public:
 		this->diffuse = diffuse;
 	}
 
-	Vector3d get_specular(){
+	Vector3d get_specular() const{
 		return this->specular;
 	}
 
@@ -139,7 +177,7 @@ public:
 		this->specular = specular;
 	}
 
-	double get_shininess(){
+	double get_shininess() const{
 		return this->shininess;
 	}
 
@@ -147,7 +185,7 @@ public:
 		this->shininess = shininess;
 	}
 
-	double get_opacity(){
+	double get_opacity() const{
 		return this->opacity;
 	}
 
@@ -155,7 +193,7 @@ public:
 		this->opacity = opacity;
 	}
 
-	int get_illum_no(){
+	int get_illum_no() const{
 		return this->illum_no;
 	}
 
@@ -165,67 +203,384 @@ public:
 
 };
 
+/* Polygons (faces or polylines) stored back to back in one index array.
+   While every polygon has the same number of corners, as in all-triangle
+   or all-quad meshes, no offsets are kept and polygon i starts at
+   i*arity; the first polygon of a different size switches to offsets. */
+class Polygon_List{
+private:
+	vector<int> indices;
+	vector<uint64_t> offsets;
+	size_t count;
+	int arity;
+	bool mixed;
+
+public:
+	Polygon_List(){
+		count = 0;
+		arity = 0;
+		mixed = false;
+	}
+
+	size_t size() const{
+		return count;
+	}
+
+	bool isUniform() const{
+		return !mixed;
+	}
+
+	int getArity() const{
+		return arity;
+	}
+
+	uint64_t offset(size_t i) const{
+		return mixed ? offsets[i] : (uint64_t) i*arity;
+	}
+
+	int corners(size_t i) const{
+		return mixed ? (int)(offsets[i+1]-offsets[i]) : arity;
+	}
+
+	const int* polygon(size_t i) const{
+		return indices.data() + offset(i);
+	}
+
+	const vector<int>& getIndices() const{
+		return indices;
+	}
+
+	void getOffsets(vector<uint64_t>& result) const{
+		if(mixed){
+			result = offsets;
+			return;
+		}
+		result.resize(count+1);
+		for(size_t i=0;i<=count;i++)
+			result[i] = (uint64_t) i*arity;
+	}
+
+	void reserve(size_t polygons, size_t total_indices){
+		indices.reserve(total_indices);
+		if(mixed)
+			offsets.reserve(polygons+1);
+	}
+
+	void add(const int* polygon, int n){
+		if(count==0)
+			arity = n;
+		else if(!mixed && n!=arity){
+			getOffsets(offsets);
+			mixed = true;
+		}
+		indices.insert(indices.end(), polygon, polygon+n);
+		count++;
+		if(mixed)
+			offsets.push_back(indices.size());
+	}
+
+	/* Appends one polygon per entry of `sizes`, taking the indices out of
+	   `indices` (moved when this list is still empty). */
+	void append(vector<int>& more, const vector<int>& sizes){
+		if(count==0){
+			indices.swap(more);
+			count = sizes.size();
+			arity = (count>0) ? sizes[0] : 0;
+			mixed = false;
+			for(size_t i=0;i<count && !mixed;i++)
+				mixed = (sizes[i]!=arity);
+			offsets.clear();
+			if(mixed){
+				offsets.resize(count+1);
+				offsets[0] = 0;
+				for(size_t i=0;i<count;i++)
+					offsets[i+1] = offsets[i]+sizes[i];
+			}
+		}
+		else{
+			reserve(count+sizes.size(), indices.size()+more.size());
+			size_t offset = 0;
+			for(size_t i=0;i<sizes.size();i++){
+				add(more.data()+offset, sizes[i]);
+				offset += sizes[i];
+			}
+		}
+		vector<int>().swap(more);
+	}
+
+	void swap(Polygon_List& other){
+		indices.swap(other.indices);
+		offsets.swap(other.offsets);
+		std::swap(count, other.count);
+		std::swap(arity, other.arity);
+		std::swap(mixed, other.mixed);
+	}
+
+	/* Replaces the contents; offsets holds count+1 entries. */
+	void assign(const int* first, size_t total_indices, const uint64_t* first_offset, size_t count){
+		indices.assign(first, first+total_indices);
+		this->count = count;
+		arity = (count>0) ? (int)(first_offset[1]-first_offset[0]) : 0;
+		mixed = false;
+		for(size_t i=0;i<count;i++){
+			if(first_offset[i+1]-first_offset[i]!=(uint64_t) arity){
+				mixed = true;
+				break;
+			}
+		}
+		if(mixed)
+			offsets.assign(first_offset, first_offset+count+1);
+		else
+			offsets.clear();
+	}
+};
+
+template<typename Scalar>
+bool three_diff_vertices(const int* face, int n, const Vertex_Array<Scalar>& points,
+	Vec3<Scalar>& v1, Vec3<Scalar>& v2, Vec3<Scalar>& v3){
+	if(n==0)
+		return false;
+	v1 = points.col(face[0]-1);
+	int index = 0;
+	while(index<n){
+		v2 = points.col(face[index]-1);
+		if(v1==v2){
+			index++;
+		}
+		else
+			break;
+	}
+	if(index>=n){
+		return false;
+	}
+	index++;
+	while(index<n){
+		v3 = points.col(face[index]-1);
+		if((v1==v3) || (v2==v3)){
+			index++;
+		}
+		else
+			break;
+	}
+	if(index>=n){
+		return false;
+	}
+	return true;
+}
+
+/* Unit normal of a face, or zero for a face without three distinct
+   corners. */
+template<typename Scalar>
+Vec3<Scalar> get_normal(const int* face, int n, const Vertex_Array<Scalar>& points){
+	Vec3<Scalar> cross(0,0,0);
+	Vec3<Scalar> v1, v2, v3;
+	if(!three_diff_vertices(face, n, points, v1, v2, v3))
+		return cross;
+	Vec3<Scalar> a = v2 - v1;
+	Vec3<Scalar> b = v3 - v1;
+	cross = a.cross(b);
+	if(cross != Vec3<Scalar>(0,0,0))
+		cross.normalize();
+	return cross;
+}
+
+/* Node of a visibility tree. Its plane is normal.x = offset in object
+   space; faces first_face .. first_face+face_count-1 of the tree lie in
+   it. Planes that only split space hold no faces. Children are node
+   indices, -1 for none. */
+struct Bsp_Node{
+	double normal[3];
+	double offset;
+	int32_t front;
+	int32_t back;
+	uint32_t first_face;
+	uint32_t face_count;
+};
+
+/* BSP tree over the face planes of a mesh. Faces that cross a splitting
+   plane are cut in two, so the tree keeps its own face list: `sources`
+   names the mesh face every fragment came from, and the corners created
+   by the cuts are numbered after the mesh vertices. */
+class Bsp_Tree{
+public:
+	vector<Bsp_Node> nodes;
+	Polygon_List faces;
+	vector<int> sources;
+	Vertex_Matrix vertices;
+
+	bool empty() const{
+		return nodes.empty();
+	}
+
+	void swap(Bsp_Tree& other){
+		nodes.swap(other.nodes);
+		faces.swap(other.faces);
+		sources.swap(other.sources);
+		vertices.swap(other.vertices);
+	}
+};
+
 class Object_3D{
 private:
-	vector< Vector3d > vertices;
-	vector< vector<int> > edges;
-	vector< vector<int> > faces;
-	map< vector<int>,string> material_of_faces;
-	map<string,Material> materials;
+	Vertex_Matrix vertices;
+	Polygon_List edges;
+	Polygon_List faces;
+	vector<int> face_materials;
+	Vertex_Matrix face_normals;
+	Bsp_Tree bsp_tree;
+	bool merged;
+	vector<Material> materials;
+	map<string,int> material_ids;
+	vector<string> material_libraries;
 	string name;
 	string type;
 
 public:
 	Object_3D(){
-
+		merged = false;
+		// id 0 is the default material of faces without a known usemtl
+		materials.push_back(Material());
+		material_ids[""] = 0;
 	}
 
-	vector<Vector3d> getVertices(){
+	const Vertex_Matrix& getVertices() const{
 		return vertices;
 	}
 
-	vector< vector<int> > getEdges(){
+	const Polygon_List& getEdges() const{
 		return edges;
 	}
 
-	vector< vector<int> > getFaces(){
+	const Polygon_List& getFaces() const{
 		return faces;
 	}
 
-	string getType(){
+	string getType() const{
 		return type;
 	}
 
-	map< vector<int>,string> getMaterialOfFaces(){
-		return material_of_faces;
+	const vector<int>& getFaceMaterials() const{
+		return face_materials;
+	}
+
+	/* Object-space unit normal of every face, one column per face. */
+	const Vertex_Matrix& getFaceNormals() const{
+		return face_normals;
+	}
+
+	void setFaceNormals(Vertex_Matrix& normals){
+		face_normals.swap(normals);
+	}
+
+	const Bsp_Tree& getBspTree() const{
+		return bsp_tree;
+	}
+
+	void setBspTree(Bsp_Tree& tree){
+		bsp_tree.swap(tree);
+	}
+
+	/* Whether coplanar faces were merged; see merge_coplanar_faces. */
+	bool isMerged() const{
+		return merged;
+	}
+
+	void setMerged(bool merged){
+		this->merged = merged;
+	}
+
+	/* Normals only depend on the mesh, so they are computed once after
+	   loading and every view just rotates them. */
+	void computeFaceNormals(){
+		face_normals.resize(3, faces.size());
+		for(size_t i=0;i<faces.size();i++){
+			face_normals.col(i) = get_normal(faces.polygon(i), faces.corners(i), vertices);
+		}
 	}
 
-	map<string,Material> getMaterials(){
+	const vector<Material>& getMaterials() const{
 		return materials;
 	}
 
-	Material getMaterialFromName(string name){
-		return materials[name];
+	const vector<string>& getMaterialLibraries() const{
+		return material_libraries;
+	}
+
+	/* Materials that are not defined (yet) map to the default id 0. */
+	int getMaterialId(const string& name){
+		map<string,int>::iterator it = material_ids.find(name);
+		return (it==material_ids.end()) ? 0 : it->second;
 	}
 
 	void addMaterial(string name, Material material){
-		this->materials[name] = material;
+		map<string,int>::iterator it = material_ids.find(name);
+		if(it!=material_ids.end()){
+			materials[it->second] = material;
+		}
+		else{
+			material_ids[name] = materials.size();
+			materials.push_back(material);
+		}
 	}
 
-	void addMaterialOfFaces(vector<int> face, string name){
-		this->material_of_faces[face] = name;
+	void addMaterialLibrary(string filename){
+		this->material_libraries.push_back(filename);
 	}
 
-	void addVertex(Vector3d point){
-		vertices.push_back(point);
+
+	/* Appends the parsed points and releases their storage. */
+	void appendVertices(vector<Vector3d>& points){
+		size_t first = vertices.cols();
+		vertices.conservativeResize(3, first+points.size());
+		for(size_t i=0;i<points.size();i++){
+			vertices.col(first+i) = points[i].cast<Real>();
+		}
+		vector<Vector3d>().swap(points);
 	}
 
-	void addEdge(vector<int> edge){
-		edges.push_back(edge);
+	void setVertices(Vertex_Matrix& points){
+		vertices.swap(points);
 	}
 
-	void addFace(vector<int> face){
-		faces.push_back(face);
+	void addEdge(const vector<int>& edge){
+		edges.add(edge.data(), edge.size());
+	}
+
+	void addEdge(const int* edge, int n){
+		edges.add(edge, n);
+	}
+
+	void addFace(const vector<int>& face, int material_id){
+		faces.add(face.data(), face.size());
+		face_materials.push_back(material_id);
+	}
+
+	void addFace(const int* face, int n, int material_id){
+		faces.add(face, n);
+		face_materials.push_back(material_id);
+	}
+
+	void setEdges(Polygon_List& edges){
+		this->edges.swap(edges);
+	}
+
+	void setFaces(Polygon_List& faces, vector<int>& face_materials){
+		this->faces.swap(faces);
+		this->face_materials.swap(face_materials);
+	}
+
+	/* Takes over the index lists of a parsed chunk; see Polygon_List::append. */
+	void appendEdges(vector<int>& indices, const vector<int>& sizes){
+		edges.append(indices, sizes);
+	}
+
+	void appendFaces(vector<int>& indices, const vector<int>& sizes, vector<int>& materials){
+		faces.append(indices, sizes);
+		if(face_materials.empty())
+			face_materials.swap(materials);
+		else
+			face_materials.insert(face_materials.end(), materials.begin(), materials.end());
+		vector<int>().swap(materials);
 	}
 
 	void setName(string name){
@@ -264,9 +619,210 @@ public:
 
 };
 
+class Mapped_File{
+private:
+	const char* data;
+	size_t size;
+	vector<char> buffer;
+#ifndef WINDOWS
+	int fd;
+#endif
+
+public:
+	Mapped_File(){
+		data = NULL;
+		size = 0;
+#ifndef WINDOWS
+		fd = -1;
+#endif
+	}
+
+	~Mapped_File(){
+		close();
+	}
+
+	bool open(string filename){
+		close();
+#ifdef WINDOWS
+		ifstream file (filename.c_str(), ios::binary);
+		if(!file.is_open())
+			return false;
+		buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+		data = buffer.empty() ? NULL : &buffer[0];
+		size = buffer.size();
+		return true;
+#else
+		fd = ::open(filename.c_str(), O_RDONLY);
+		if(fd<0)
+			return false;
+		struct stat info;
+		if(fstat(fd,&info)!=0){
+			close();
+			return false;
+		}
+		size = info.st_size;
+		if(size>0){
+			void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(addr == MAP_FAILED){
+				close();
+				return false;
+			}
+			madvise(addr, size, MADV_SEQUENTIAL);
+			data = (const char*) addr;
+		}
+		return true;
+#endif
+	}
+
+	void close(){
+#ifndef WINDOWS
+		if(data!=NULL)
+			munmap((void*) data, size);
+		if(fd>=0)
+			::close(fd);
+		fd = -1;
+#endif
+		buffer.clear();
+		data = NULL;
+		size = 0;
+	}
+
+	const char* begin(){
+		return data;
+	}
+
+	const char* end(){
+		return data+size;
+	}
+
+	size_t length(){
+		return size;
+	}
+};
+
+/* Tokenizer used by the mapped parsers. Tokens are split on the same
+   whitespace as istream_iterator<string>, and numbers follow strtod/atoi
+   prefix semantics so that results match the stream based parser. */
+inline bool is_blank(char c){
+	return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f';
+}
+
+inline const char* skip_blanks(const char* p, const char* end){
+	while(p<end && is_blank(*p))
+		p++;
+	return p;
+}
+
+inline const char* token_end(const char* p, const char* end){
+	while(p<end && !is_blank(*p))
+		p++;
+	return p;
+}
+
+inline bool token_is(const char* p, const char* end, const char* word){
+	size_t len = strlen(word);
+	return (size_t)(end-p) == len && memcmp(p,word,len)==0;
+}
+
+double scan_double_slow(const char* p, const char* end){
+	char buff[64];
+	size_t len = end-p;
+	if(len<sizeof(buff)){
+		memcpy(buff,p,len);
+		buff[len] = '\0';
+		return strtod(buff,NULL);
+	}
+	return strtod(string(p,end).c_str(),NULL);
+}
+
+/* Exact for up to 19 significant digits and |exponent| <= 22, where a
+   single multiplication or division by a power of ten is correctly
+   rounded. Everything else is handed to strtod. */
+double scan_double(const char* p, const char* end){
+	static const double powers_of_ten[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+		1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char* start = p;
+	bool negative = false;
+	if(p<end && (*p=='-' || *p=='+')){
+		negative = (*p=='-');
+		p++;
+	}
+	if(end-p>1 && p[0]=='0' && (p[1]=='x' || p[1]=='X'))
+		return scan_double_slow(start,end);
+	uint64_t mantissa = 0;
+	int digits = 0, significant = 0, exponent = 0;
+	while(p<end && *p>='0' && *p<='9'){
+		if(mantissa!=0 || *p!='0')
+			significant++;
+		mantissa = mantissa*10 + (*p-'0');
+		digits++;
+		p++;
+		if(significant>19)
+			return scan_double_slow(start,end);
+	}
+	if(p<end && *p=='.'){
+		p++;
+		while(p<end && *p>='0' && *p<='9'){
+			if(mantissa!=0 || *p!='0')
+				significant++;
+			mantissa = mantissa*10 + (*p-'0');
+			digits++;
+			exponent--;
+			p++;
+			if(significant>19)
+				return scan_double_slow(start,end);
+		}
+	}
+	if(digits==0)
+		return scan_double_slow(start,end);
+	if(p<end && (*p=='e' || *p=='E')){
+		const char* q = p+1;
+		bool exp_negative = false;
+		if(q<end && (*q=='-' || *q=='+')){
+			exp_negative = (*q=='-');
+			q++;
+		}
+		if(q<end && *q>='0' && *q<='9'){
+			int exp_value = 0;
+			while(q<end && *q>='0' && *q<='9'){
+				if(exp_value<10000)
+					exp_value = exp_value*10 + (*q-'0');
+				q++;
+			}
+			exponent += exp_negative ? -exp_value : exp_value;
+		}
+	}
+	if(mantissa > (((uint64_t)1)<<53) || exponent < -22 || exponent > 22)
+		return scan_double_slow(start,end);
+	double value = (double) mantissa;
+	if(exponent<0)
+		value /= powers_of_ten[-exponent];
+	else
+		value *= powers_of_ten[exponent];
+	return negative ? -value : value;
+}
+
+int scan_int(const char* p, const char* end){
+	bool negative = false;
+	if(p<end && (*p=='-' || *p=='+')){
+		negative = (*p=='-');
+		p++;
+	}
+	long value = 0;
+	while(p<end && *p>='0' && *p<='9'){
+		value = value*10 + (*p-'0');
+		p++;
+	}
+	return (int)(negative ? -value : value);
+}
+
 void parse_material(Object_3D& obj, string filename, string current_dir){
 	string line;
 	filename = current_dir+filename;
+	obj.addMaterialLibrary(filename);
 	ifstream file (filename.c_str());
 	if(file.is_open()){
 		int count_newmtl = 0;
@@ -331,11 +887,12 @@ void parse_material(Object_3D& obj, string filename, string current_dir){
 	}
 }
 
-bool parse_object(string filename, Object_3D& obj, string current_dir){
+bool parse_object_stream(string filename, Object_3D& obj, string current_dir){
 	string line;
 	ifstream file (filename.c_str());
 	if(file.is_open()){
-		Material material;
+		int material_id = 0;
+		vector<Vector3d> vertices;
 		while(getline(file,line)){
 			istringstream iss(line);
 			vector<string> tokens;
@@ -351,7 +908,7 @@ bool parse_object(string filename, Object_3D& obj, string current_dir){
 					vertex(0) = strtod(tokens[1].c_str(),NULL);
 					vertex(1) = strtod(tokens[2].c_str(),NULL);
 					vertex(2) = strtod(tokens[3].c_str(),NULL);
-					obj.addVertex(vertex);
+					vertices.push_back(vertex);
 				}
 				else if(tokens[0]=="l"){
 					for(int i=1;i<tokens.size();i++){
@@ -364,8 +921,7 @@ bool parse_object(string filename, Object_3D& obj, string current_dir){
 						int vertex_no = atoi(tokens[i].c_str());
 						face.push_back(vertex_no);
 					}
-					obj.addFace(face);
-					obj.addMaterialOfFaces(face,material.get_name());
+					obj.addFace(face,material_id);
 				}
 				else if(tokens[0]=="mtllib"){
 					string file_name = tokens[1];
@@ -373,11 +929,12 @@ bool parse_object(string filename, Object_3D& obj, string current_dir){
 				}
 				else if(tokens[0]=="usemtl"){
 					string name = tokens[1];
-					material = obj.getMaterialFromName(name);
+					material_id = obj.getMaterialId(name);
 				}
 			}
 		}
 		file.close();
+		obj.appendVertices(vertices);
 		return true;
 	}
 	else {
@@ -391,368 +948,3435 @@ bool parse_object(string filename, Object_3D& obj, string current_dir){
 	}
 }
 
-string get_current_directory(string filename) {
-	char buff[FILENAME_MAX];
-	GetCurrentDir( buff, FILENAME_MAX );
-	string current_working_dir(buff);
-	current_working_dir+='/';
-	int index = filename.length()-1;
-	while(index>=0){
-		if(filename[index]=='/')
-			break;
-		index--;
+/* Runs function(0..count-1) on up to `threads` workers which pull
+   indices from a shared counter. */
+template<typename Function>
+void parallel_for(int count, int threads, Function function){
+	if(threads>count)
+		threads = count;
+	if(threads<=1){
+		for(int i=0;i<count;i++)
+			function(i);
+		return;
 	}
-	for(int i=0;i<=index;i++){
-		current_working_dir+=filename[i];
+	atomic<int> next(0);
+	vector<thread> workers;
+	for(int t=0;t<threads;t++){
+		workers.push_back(thread([&](){
+			for(int i=next++;i<count;i=next++)
+				function(i);
+		}));
 	}
-	return current_working_dir;
+	for(int t=0;t<threads;t++)
+		workers[t].join();
 }
 
+const int MTLLIB_EVENT = 0;
+const int USEMTL_EVENT = 1;
 
-string get_filename(string str){
-	string filename = "";
-	int index = str.length()-1;
-	while(index>=0){
-		if(str[index]=='/')
-			break;
-		index--;
-	}
-	index++;
-	for(;str[index]!='.';index++)
-		filename += str[index];
-	//cout<<filename<<endl;
-	return (filename);
-}
+/* mtllib/usemtl records of a chunk, tagged with the number of faces of
+   the chunk that precede them. */
+class Obj_Event{
+public:
+	int kind;
+	size_t face_count;
+	string name;
 
-vector< pair<string,double> > get_rotations(char* argv[]){
-	/*cout<<"Enter rotation axes and angles: "<<endl;
-	string rotation_string = "";
-	getline(cin,rotation_string);
+	Obj_Event(int kind, size_t face_count, string name){
+		this->kind = kind;
+		this->face_count = face_count;
+		this->name = name;
+	}
+};
 
-	istringstream iss(rotation_string);
-	vector<string> tokens;
-	copy(istream_iterator<string>(iss),
-	     istream_iterator<string>(),
-	     back_inserter(tokens));
-	vector< pair<string,double> > rotations;
-	if(tokens.size()>0){
-		for(int i=0;i<tokens.size();i+=2){
-			string axis = tokens[i];
-			double angle = strtod(tokens[i+1].c_str(),NULL);
-			pair<string,double> one_rotation(axis,angle);
-			rotations.push_back(one_rotation);
-		}
-	}*/
-	vector< pair<string,double> > rotations;
+class Obj_Chunk{
+public:
+	vector<Vector3d> vertices;
+	vector<int> face_indices;
+	vector<int> face_sizes;
+	vector<int> edge_indices;
+	vector<int> edge_sizes;
+	vector<Obj_Event> events;
+};
 
-	rotations.push_back(make_pair("x", atof(argv[2])));
-	rotations.push_back(make_pair("y", atof(argv[2])));
-	rotations.push_back(make_pair("z", atof(argv[2])));
-	return rotations;
+void parse_object_chunk(const char* p, const char* end, Obj_Chunk& chunk){
+	while(p<end){
+		const char* line_end = (const char*) memchr(p,'\n',end-p);
+		if(line_end==NULL)
+			line_end = end;
+		p = skip_blanks(p,line_end);
+		if(p<line_end && *p!='#'){
+			const char* key_end = token_end(p,line_end);
+			const char* q = skip_blanks(key_end,line_end);
+			if(token_is(p,key_end,"v")){
+				Vector3d vertex(0,0,0);
+				for(int i=0;i<3 && q<line_end;i++){
+					const char* t = token_end(q,line_end);
+					vertex(i) = scan_double(q,t);
+					q = skip_blanks(t,line_end);
+				}
+				chunk.vertices.push_back(vertex);
+			}
+			else if(token_is(p,key_end,"f") || token_is(p,key_end,"l")){
+				vector<int>& indices = (*p=='f') ? chunk.face_indices : chunk.edge_indices;
+				size_t first = indices.size();
+				while(q<line_end){
+					const char* t = token_end(q,line_end);
+					indices.push_back(scan_int(q,t));
+					q = skip_blanks(t,line_end);
+				}
+				if(*p=='f')
+					chunk.face_sizes.push_back(indices.size()-first);
+				else
+					chunk.edge_sizes.push_back(indices.size()-first);
+			}
+			else if(token_is(p,key_end,"mtllib")){
+				chunk.events.push_back(Obj_Event(MTLLIB_EVENT, chunk.face_sizes.size(),
+					string(q,token_end(q,line_end))));
+			}
+			else if(token_is(p,key_end,"usemtl")){
+				chunk.events.push_back(Obj_Event(USEMTL_EVENT, chunk.face_sizes.size(),
+					string(q,token_end(q,line_end))));
+			}
+		}
+		p = line_end+1;
+	}
 }
 
-Matrix3d rot_x(Matrix3d matrix, double angle){
-	Matrix3d trans_mat;
-	trans_mat << 	1,     0     ,      0     ,
-					0, cos(angle), -sin(angle),
-					0, sin(angle),  cos(angle);
-	return trans_mat*matrix;
-}
+/* Appends a chunk to obj, replaying its material records in file order.
+   `material_id` carries the usemtl state from one chunk to the next. */
+void merge_object_chunk(Obj_Chunk& chunk, Object_3D& obj, int& material_id,
+	string current_dir){
+	vector<int> face_materials(chunk.face_sizes.size());
+	size_t event = 0;
+	for(size_t i=0;i<=chunk.face_sizes.size();i++){
+		while(event<chunk.events.size() && chunk.events[event].face_count==i){
+			if(chunk.events[event].kind == MTLLIB_EVENT)
+				parse_material(obj,chunk.events[event].name,current_dir);
+			else
+				material_id = obj.getMaterialId(chunk.events[event].name);
+			event++;
+		}
+		if(i<chunk.face_sizes.size())
+			face_materials[i] = material_id;
+	}
 
-Matrix3d rot_y(Matrix3d matrix, double angle){
-	Matrix3d trans_mat;
-	trans_mat << 	cos(angle),     0     , sin(angle),
-					    0     ,     1     ,     0     ,
-				   -sin(angle),     0     , cos(angle);
-	return trans_mat*matrix;
+	obj.appendVertices(chunk.vertices);
+	obj.appendEdges(chunk.edge_indices, chunk.edge_sizes);
+	obj.appendFaces(chunk.face_indices, chunk.face_sizes, face_materials);
 }
 
-Matrix3d rot_z(Matrix3d matrix, double angle){
-	Matrix3d trans_mat;
-	trans_mat << 	cos(angle), -sin(angle),    0    ,
-					sin(angle),  cos(angle),    0    ,
-					    0     ,      0     ,    1    ;
-	return trans_mat*matrix;
-}
+/* Chunks smaller than this are not worth a thread of their own. */
+const size_t MIN_CHUNK_SIZE = 1<<20;
 
-Matrix3d rotate(Matrix3d matrix, double angle, string axis){
-	if(axis == "x" || axis == "X")
-		matrix = rot_x(matrix,angle);
-	else if(axis == "y" || axis == "Y")
-		matrix = rot_y(matrix, angle);
-	else if(axis == "z" || axis == "Z"){
-		matrix = rot_z(matrix, angle);
+bool parse_object(string filename, Object_3D& obj, string current_dir, int threads = 1){
+	Mapped_File file;
+	if(!file.open(filename)){
+		try{
+			throw "Unable to open file ";
+		}
+		catch(char const* e){
+			cout<<e<<filename<<endl;
+		}
+		return false;
+	}
+
+	const char* begin = file.begin();
+	const char* end = file.end();
+	size_t chunk_count = file.length()/MIN_CHUNK_SIZE;
+	if(chunk_count>(size_t)threads)
+		chunk_count = threads;
+	if(chunk_count<1)
+		chunk_count = 1;
+
+	// split at newline boundaries so that no record straddles two chunks
+	vector<const char*> bounds(chunk_count+1, end);
+	bounds[0] = begin;
+	for(size_t i=1;i<chunk_count;i++){
+		const char* p = begin + file.length()/chunk_count*i;
+		if(p<bounds[i-1])
+			p = bounds[i-1];
+		const char* newline = (const char*) memchr(p,'\n',end-p);
+		bounds[i] = (newline==NULL) ? end : newline+1;
+	}
+
+	vector<Obj_Chunk> chunks(chunk_count);
+	parallel_for(chunk_count, threads, [&](int i){
+		parse_object_chunk(bounds[i], bounds[i+1], chunks[i]);
+	});
+
+	int material_id = 0;
+	for(size_t i=0;i<chunk_count;i++){
+		merge_object_chunk(chunks[i], obj, material_id, current_dir);
+		chunks[i] = Obj_Chunk();
+	}
+	return true;
+}
+
+/* Sets of more faces than this are split by the best of a few sampled face
+   planes, or by a median plane when none of them divides the set evenly
+   enough; smaller sets take their first face as the splitter. */
+const size_t BSP_CHAIN_LIMIT = 64;
+const int BSP_CANDIDATES = 8;
+const size_t BSP_SAMPLE = 256;
+/* A face plane is taken when its smaller side gets at least this
+   fraction of the sampled faces. */
+const double BSP_MIN_BALANCE = 0.1;
+/* Corners closer to a plane than this fraction of the mesh size lie in
+   it. */
+const double BSP_EPSILON = 1e-6;
+
+const int BSP_FRONT = 1;
+const int BSP_BACK = 2;
+const int BSP_SPANNING = 3;
+const int BSP_COPLANAR = 0;
+
+class Bsp_Builder{
+private:
+	const Object_3D& obj;
+	int mesh_vertex_count;
+	double epsilon;
+	vector<int> indices;
+	vector<size_t> offsets;
+	vector<int> sources;
+	vector<Vector3d> added;
+	vector<int> node_faces;
+	vector<Bsp_Node> nodes;
+
+	Vector3d point(int index) const{
+		if(index<=mesh_vertex_count)
+			return obj.getVertices().col(index-1).template cast<double>();
+		return added[index-mesh_vertex_count-1];
+	}
+
+	int corners(int fragment) const{
+		return offsets[fragment+1]-offsets[fragment];
+	}
+
+	const int* polygon(int fragment) const{
+		return indices.data()+offsets[fragment];
+	}
+
+	int addFragment(const int* corners, int n, int source){
+		indices.insert(indices.end(), corners, corners+n);
+		offsets.push_back(indices.size());
+		sources.push_back(source);
+		return sources.size()-1;
+	}
+
+	void getPlane(int fragment, Vector3d& normal, double& offset) const{
+		int source = sources[fragment];
+		normal = obj.getFaceNormals().col(source).template cast<double>();
+		offset = normal.dot(point(obj.getFaces().polygon(source)[0]));
+	}
+
+	int classify(int fragment, const Vector3d& normal, double offset) const{
+		const int* face = polygon(fragment);
+		int n = corners(fragment), side = BSP_COPLANAR;
+		for(int i=0;i<n;i++){
+			double distance = normal.dot(point(face[i])) - offset;
+			if(distance>epsilon)
+				side |= BSP_FRONT;
+			else if(distance<-epsilon)
+				side |= BSP_BACK;
+		}
+		return side;
+	}
+
+	/* Cuts a spanning fragment along the plane; pieces with fewer than
+	   three corners are dropped (-1). */
+	void split(int fragment, const Vector3d& normal, double offset, int& front, int& back){
+		int n = corners(fragment);
+		vector<int> face(polygon(fragment), polygon(fragment)+n);
+		vector<int> front_face, back_face;
+		vector<double> distance(n);
+		for(int i=0;i<n;i++)
+			distance[i] = normal.dot(point(face[i])) - offset;
+		for(int i=0;i<n;i++){
+			int j = (i+1)%n;
+			if(distance[i]>=-epsilon)
+				front_face.push_back(face[i]);
+			if(distance[i]<=epsilon)
+				back_face.push_back(face[i]);
+			if((distance[i]>epsilon && distance[j]<-epsilon) ||
+				(distance[i]<-epsilon && distance[j]>epsilon)){
+				double t = distance[i]/(distance[i]-distance[j]);
+				Vector3d a = point(face[i]), b = point(face[j]);
+				added.push_back(a + t*(b-a));
+				int index = mesh_vertex_count + added.size();
+				front_face.push_back(index);
+				back_face.push_back(index);
+			}
+		}
+		int source = sources[fragment];
+		front = (front_face.size()>=3) ? addFragment(front_face.data(), front_face.size(), source) : -1;
+		back = (back_face.size()>=3) ? addFragment(back_face.data(), back_face.size(), source) : -1;
+	}
+
+	Vector3d centroid(int fragment) const{
+		const int* face = polygon(fragment);
+		int n = corners(fragment);
+		Vector3d sum(0,0,0);
+		for(int i=0;i<n;i++)
+			sum += point(face[i]);
+		return sum/n;
+	}
+
+	/* Picks the splitting plane of a set; `splitter` is the fragment it
+	   was taken from, or -1 for a median plane. */
+	void choosePlane(const vector<int>& set, Vector3d& normal, double& offset, int& splitter) const{
+		splitter = set[0];
+		getPlane(splitter, normal, offset);
+		if(set.size()<=BSP_CHAIN_LIMIT)
+			return;
+
+		size_t step = max((size_t) 1, set.size()/BSP_SAMPLE);
+		double best_score = -1, best_balance = 0;
+		for(int c=0;c<BSP_CANDIDATES;c++){
+			int candidate = set[set.size()*c/BSP_CANDIDATES];
+			Vector3d candidate_normal;
+			double candidate_offset;
+			getPlane(candidate, candidate_normal, candidate_offset);
+			size_t front = 0, back = 0, spanning = 0, sampled = 0;
+			for(size_t i=0;i<set.size();i+=step){
+				int side = classify(set[i], candidate_normal, candidate_offset);
+				front += (side==BSP_FRONT);
+				back += (side==BSP_BACK);
+				spanning += (side==BSP_SPANNING);
+				sampled++;
+			}
+			double score = fabs((double) front - (double) back) + 8.0*spanning;
+			if(best_score<0 || score<best_score){
+				best_score = score;
+				best_balance = (double) min(front, back)/sampled;
+				splitter = candidate;
+				normal = candidate_normal;
+				offset = candidate_offset;
+			}
+		}
+		if(best_balance>=BSP_MIN_BALANCE)
+			return;
+
+		// no face plane divides the set: cut its longest side at the median
+		vector<Vector3d> centers;
+		for(size_t i=0;i<set.size();i+=step)
+			centers.push_back(centroid(set[i]));
+		Vector3d lower = centers[0], upper = centers[0];
+		for(size_t i=1;i<centers.size();i++){
+			lower = lower.cwiseMin(centers[i]);
+			upper = upper.cwiseMax(centers[i]);
+		}
+		int axis;
+		(upper-lower).maxCoeff(&axis);
+		vector<double> coordinates(centers.size());
+		for(size_t i=0;i<centers.size();i++)
+			coordinates[i] = centers[i](axis);
+		nth_element(coordinates.begin(), coordinates.begin()+coordinates.size()/2, coordinates.end());
+		Vector3d median_normal(0,0,0);
+		median_normal(axis) = 1;
+		double median_offset = coordinates[coordinates.size()/2];
+
+		// only take it if both sides get smaller
+		size_t front = 0, back = 0;
+		for(size_t i=0;i<set.size();i++){
+			int side = classify(set[i], median_normal, median_offset);
+			front += (side!=BSP_BACK);
+			back += (side!=BSP_FRONT);
+		}
+		if(front<set.size() && back<set.size()){
+			splitter = -1;
+			normal = median_normal;
+			offset = median_offset;
+		}
+	}
+
+	int build(vector<int>& set){
+		Vector3d normal;
+		double offset;
+		int splitter;
+		choosePlane(set, normal, offset, splitter);
+
+		Bsp_Node node;
+		for(int k=0;k<3;k++)
+			node.normal[k] = normal(k);
+		node.offset = offset;
+		node.first_face = node_faces.size();
+		vector<int> front, back;
+		for(size_t i=0;i<set.size();i++){
+			int side = (set[i]==splitter) ? BSP_COPLANAR : classify(set[i], normal, offset);
+			if(side==BSP_COPLANAR)
+				node_faces.push_back(set[i]);
+			else if(side==BSP_FRONT)
+				front.push_back(set[i]);
+			else if(side==BSP_BACK)
+				back.push_back(set[i]);
+			else{
+				int front_piece, back_piece;
+				split(set[i], normal, offset, front_piece, back_piece);
+				if(front_piece>=0)
+					front.push_back(front_piece);
+				if(back_piece>=0)
+					back.push_back(back_piece);
+			}
+		}
+		node.face_count = node_faces.size()-node.first_face;
+		vector<int>().swap(set);
+
+		int index = nodes.size();
+		nodes.push_back(node);
+		int front_child = front.empty() ? -1 : build(front);
+		int back_child = back.empty() ? -1 : build(back);
+		nodes[index].front = front_child;
+		nodes[index].back = back_child;
+		return index;
+	}
+
+public:
+	Bsp_Builder(const Object_3D& obj) : obj(obj){
+		mesh_vertex_count = obj.getVertices().cols();
+		epsilon = 0;
+		if(mesh_vertex_count>0){
+			const Vertex_Matrix& vertices = obj.getVertices();
+			Vector3d size = (vertices.rowwise().maxCoeff() - vertices.rowwise().minCoeff()).template cast<double>();
+			epsilon = BSP_EPSILON*size.norm();
+		}
+	}
+
+	/* Faces without a normal are left out; they are never drawn. */
+	void build(Bsp_Tree& tree){
+		const Polygon_List& faces = obj.getFaces();
+		const Vertex_Matrix& normals = obj.getFaceNormals();
+		offsets.push_back(0);
+		vector<int> set;
+		for(size_t i=0;i<faces.size();i++){
+			if(normals.col(i)!=Vec3<Real>(0,0,0))
+				set.push_back(addFragment(faces.polygon(i), faces.corners(i), i));
+		}
+		if(!set.empty())
+			build(set);
+
+		tree.nodes.swap(nodes);
+		tree.faces = Polygon_List();
+		tree.sources.resize(node_faces.size());
+		for(size_t i=0;i<node_faces.size();i++){
+			tree.faces.add(polygon(node_faces[i]), corners(node_faces[i]));
+			tree.sources[i] = sources[node_faces[i]];
+		}
+		tree.vertices.resize(3, added.size());
+		for(size_t i=0;i<added.size();i++)
+			tree.vertices.col(i) = added[i].cast<Real>();
+	}
+};
+
+/* Appends the faces of `tree` in back-to-front order for a viewer given
+   in object space as a homogeneous point: (eye, 1) for perspective, or
+   (direction towards the viewer, 0) for parallel projection. Only
+   fragments of faces with `visible` set are listed. */
+void get_bsp_order(const Bsp_Tree& tree, const Vector4d& viewer, const vector<char>& visible,
+	vector<int>& order){
+	if(tree.empty())
+		return;
+	// non-negative entries are nodes to expand, ~node emits a node's faces
+	vector<int> stack(1, 0);
+	while(!stack.empty()){
+		int entry = stack.back();
+		stack.pop_back();
+		if(entry<0){
+			const Bsp_Node& node = tree.nodes[~entry];
+			for(uint32_t i=node.first_face;i<node.first_face+node.face_count;i++){
+				if(visible[tree.sources[i]])
+					order.push_back(i);
+			}
+			continue;
+		}
+		const Bsp_Node& node = tree.nodes[entry];
+		double side = node.normal[0]*viewer(0) + node.normal[1]*viewer(1) +
+			node.normal[2]*viewer(2) - node.offset*viewer(3);
+		// the far side is drawn first, so it goes on the stack last
+		int near_child = (side>=0) ? node.front : node.back;
+		int far_child = (side>=0) ? node.back : node.front;
+		if(near_child>=0)
+			stack.push_back(near_child);
+		stack.push_back(~entry);
+		if(far_child>=0)
+			stack.push_back(far_child);
+	}
+}
+
+/* Coplanar faces of one material merge when their normals agree to
+   within MERGE_NORMAL_TOLERANCE (1 - cosine of the angle) and their
+   corners lie within MERGE_PLANE_TOLERANCE of the mesh size of the first
+   face's plane. */
+const double MERGE_NORMAL_TOLERANCE = 1e-6;
+const double MERGE_PLANE_TOLERANCE = 1e-6;
+
+/* Merges connected coplanar faces of one material into single polygons.
+   Regions grow over edges shared by exactly two faces, and only while
+   they stay a disk: a face joins when it shares one unbroken run of
+   edges with the region's outline and its other corners are not on the
+   outline. A flat area with holes therefore becomes a few polygons
+   around each hole instead of one polygon with holes, so every face
+   keeps a single outline for culling, clipping, sorting and the BSP
+   tree. Corners left in the middle of a straight outline are dropped.
+   The normals are kept, and the BSP tree, which refers to the old
+   faces, is cleared. */
+void merge_coplanar_faces(Object_3D& obj){
+	const Polygon_List& faces = obj.getFaces();
+	const Vertex_Matrix& vertices = obj.getVertices();
+	const Vertex_Matrix& normals = obj.getFaceNormals();
+	const vector<int>& face_materials = obj.getFaceMaterials();
+	size_t face_count = faces.size();
+	int vertex_count = vertices.cols();
+	if(face_count==0)
+		return;
+
+	// faces across every edge that exactly two faces share
+	vector< pair<uint64_t,int> > edge_faces;
+	for(size_t f=0;f<face_count;f++){
+		const int* face = faces.polygon(f);
+		int n = faces.corners(f);
+		for(int k=0;k<n;k++){
+			uint64_t a = face[k], b = face[(k+1)%n];
+			edge_faces.push_back(make_pair((min(a,b)<<32) | max(a,b), (int) f));
+		}
+	}
+	sort(edge_faces.begin(), edge_faces.end());
+	vector< pair<int,int> > links;
+	for(size_t i=0;i<edge_faces.size();){
+		size_t j = i;
+		while(j<edge_faces.size() && edge_faces[j].first==edge_faces[i].first)
+			j++;
+		if(j-i==2 && edge_faces[i].second!=edge_faces[i+1].second){
+			links.push_back(make_pair(edge_faces[i].second, edge_faces[i+1].second));
+			links.push_back(make_pair(edge_faces[i+1].second, edge_faces[i].second));
+		}
+		i = j;
+	}
+	vector< pair<uint64_t,int> >().swap(edge_faces);
+	sort(links.begin(), links.end());
+	vector<size_t> link_offsets(face_count+1, 0);
+	for(size_t i=0;i<links.size();i++)
+		link_offsets[links[i].first+1]++;
+	for(size_t f=0;f<face_count;f++)
+		link_offsets[f+1] += link_offsets[f];
+
+	Vector3d size = (vertices.rowwise().maxCoeff() - vertices.rowwise().minCoeff()).template cast<double>();
+	double plane_tolerance = MERGE_PLANE_TOLERANCE*size.norm();
+
+	// the outline of the growing region: next[v] follows v on it while
+	// outline[v] holds the region's id
+	vector<int> next(vertex_count+1, 0), outline(vertex_count+1, -1);
+	vector<int> region(face_count, -1), queue, corners, loop;
+	vector<char> shared;
+	Polygon_List merged;
+	vector<int> merged_materials;
+	Vertex_Matrix merged_normals(3, face_count);
+	for(size_t seed=0;seed<face_count;seed++){
+		if(region[seed]>=0)
+			continue;
+		int id = merged.size();
+		region[seed] = id;
+		const int* seed_face = faces.polygon(seed);
+		int seed_corners = faces.corners(seed);
+		merged_normals.col(id) = normals.col(seed);
+		merged_materials.push_back(face_materials[seed]);
+
+		corners.assign(seed_face, seed_face+seed_corners);
+		sort(corners.begin(), corners.end());
+		if(adjacent_find(corners.begin(), corners.end())!=corners.end() ||
+			normals.col(seed)==Vec3<Real>(0,0,0)){
+			merged.add(seed_face, seed_corners);
+			continue;
+		}
+		Vector3d normal = normals.col(seed).template cast<double>();
+		double offset = normal.dot(vertices.col(seed_face[0]-1).template cast<double>());
+		for(int k=0;k<seed_corners;k++){
+			next[seed_face[k]] = seed_face[(k+1)%seed_corners];
+			outline[seed_face[k]] = id;
+		}
+
+		int members = 1;
+		queue.clear();
+		for(size_t l=link_offsets[seed];l<link_offsets[seed+1];l++)
+			queue.push_back(links[l].second);
+		for(size_t head=0;head<queue.size();head++){
+			int f = queue[head];
+			if(region[f]>=0 || face_materials[f]!=face_materials[seed] ||
+				normal.dot(normals.col(f).template cast<double>())<1-MERGE_NORMAL_TOLERANCE)
+				continue;
+			const int* face = faces.polygon(f);
+			int n = faces.corners(f);
+			bool flat = true;
+			for(int k=0;k<n && flat;k++)
+				flat = fabs(normal.dot(vertices.col(face[k]-1).template cast<double>())-offset)<=plane_tolerance;
+			corners.assign(face, face+n);
+			sort(corners.begin(), corners.end());
+			if(!flat || adjacent_find(corners.begin(), corners.end())!=corners.end())
+				continue;
+
+			// edge k runs from corner k to k+1; it is shared when the
+			// outline runs the other way
+			shared.assign(n, 0);
+			int shared_count = 0, runs = 0;
+			for(int k=0;k<n;k++){
+				int a = face[k], b = face[(k+1)%n];
+				shared[k] = (outline[b]==id && next[b]==a);
+				shared_count += shared[k];
+			}
+			for(int k=0;k<n;k++)
+				runs += (shared[k] && !shared[(k+1)%n]);
+			if(shared_count==0 || shared_count==n || runs!=1)
+				continue;
+			bool disk = true;
+			for(int k=0;k<n && disk;k++){
+				if(!shared[k] && !shared[(k+n-1)%n] && outline[face[k]]==id)
+					disk = false;
+			}
+			if(!disk)
+				continue;
+
+			region[f] = id;
+			members++;
+			for(int k=0;k<n;k++){
+				if(shared[k])
+					outline[face[(k+1)%n]] = -1;
+			}
+			for(int k=0;k<n;k++){
+				if(!shared[k]){
+					next[face[k]] = face[(k+1)%n];
+					outline[face[k]] = id;
+				}
+			}
+			for(size_t l=link_offsets[f];l<link_offsets[f+1];l++)
+				queue.push_back(links[l].second);
+		}
+		if(members==1){
+			merged.add(seed_face, seed_corners);
+			continue;
+		}
+
+		// walk the outline from a corner of the seed that is still on it
+		int start = -1;
+		for(int k=0;k<seed_corners && start<0;k++){
+			if(outline[seed_face[k]]==id)
+				start = seed_face[k];
+		}
+		loop.clear();
+		for(int v=start;loop.empty() || v!=start;v=next[v])
+			loop.push_back(v);
+
+		// drop corners within the plane tolerance of the line between the
+		// corners kept before and after them
+		corners.clear();
+		int n = loop.size();
+		for(int k=0;k<n;k++){
+			Vector3d a = vertices.col(((corners.empty()) ? loop[(k+n-1)%n] : corners.back())-1).template cast<double>();
+			Vector3d b = vertices.col(loop[k]-1).template cast<double>();
+			Vector3d c = vertices.col(loop[(k+1)%n]-1).template cast<double>();
+			Vector3d ab = b-a, ac = c-a;
+			if(ac.norm()==0 || ab.dot(ac)<=0 || ab.dot(ac)>=ac.squaredNorm() ||
+				ab.cross(ac).norm()>plane_tolerance*ac.norm())
+				corners.push_back(loop[k]);
+		}
+		if(corners.size()<3)
+			corners.swap(loop);
+		merged.add(corners.data(), corners.size());
+	}
+
+	merged_normals.conservativeResize(3, merged.size());
+	obj.setFaces(merged, merged_materials);
+	obj.setFaceNormals(merged_normals);
+	Bsp_Tree none;
+	obj.setBspTree(none);
+	obj.setMerged(true);
+}
+
+/* Edges on the mesh border or between two materials are held in place
+   by planes through the edge, perpendicular to its face, weighted this
+   much more than the face planes. */
+const double DECIMATE_BORDER_WEIGHT = 1000;
+/* A collapse is refused when it turns a face's normal by more than about
+   80 degrees (cosine below this). */
+const double DECIMATE_MIN_NORMAL_DOT = 0.2;
+/* Every collapse also costs this much of the average face area times the
+   squared edge length, so that flat areas, where the error is zero, lose
+   their shortest edges first instead of collapsing into one fan. */
+const double DECIMATE_LENGTH_WEIGHT = 1e-3;
+
+/* Quadric error metric (Garland and Heckbert): the sum of the squared
+   distances to a set of planes, kept as the 10 distinct entries of the
+   symmetric 4x4 matrix. */
+class Quadric{
+public:
+	double q[10];
+
+	Quadric(){
+		for(int i=0;i<10;i++)
+			q[i] = 0;
+	}
+
+	void addPlane(const Vector3d& normal, double offset, double weight){
+		double a = normal(0), b = normal(1), c = normal(2), d = -offset;
+		double terms[10] = {a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d};
+		for(int i=0;i<10;i++)
+			q[i] += weight*terms[i];
+	}
+
+	void add(const Quadric& other){
+		for(int i=0;i<10;i++)
+			q[i] += other.q[i];
+	}
+
+	double getError(const Vector3d& v) const{
+		double x = v(0), y = v(1), z = v(2);
+		return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x +
+			q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y + q[7]*z*z + 2*q[8]*z + q[9];
+	}
+
+	/* The point of least error, when the quadric pins one down. */
+	bool getMinimum(Vector3d& v) const{
+		Matrix3d a;
+		a << q[0], q[1], q[2],
+			q[1], q[4], q[5],
+			q[2], q[5], q[7];
+		if(fabs(a.determinant())<1e-12*pow(a.norm(), 3))
+			return false;
+		v = a.inverse()*Vector3d(-q[3], -q[6], -q[8]);
+		return true;
+	}
+};
+
+/* Splits a planar simple polygon into triangles by ear clipping, in the
+   plane its Newell normal is most nearly perpendicular to. Adds their
+   0-based corners to `triangles` in the polygon's winding; a convex
+   polygon comes out as the fan from its first corner. Faces merged by
+   merge_coplanar_faces need this, since they need not be convex. */
+void triangulate_polygon(const int* face, int n, const vector<Vector3d>& positions,
+	vector<int>& triangles){
+	Vector3d normal(0,0,0);
+	for(int k=0;k<n;k++){
+		const Vector3d& a = positions[face[k]-1];
+		const Vector3d& b = positions[face[(k+1)%n]-1];
+		normal += a.cross(b);
+	}
+	int axis = 0;
+	normal.cwiseAbs().maxCoeff(&axis);
+	int u = (axis+1)%3, v = (axis+2)%3;
+	double sign = (normal(axis)>=0) ? 1 : -1;
+
+	vector<int> left(face, face+n);
+	// twice the signed area of abc in the plane, positive for a turn
+	// that follows the polygon's winding
+	auto turn = [&](int a, int b, int c){
+		const Vector3d& pa = positions[a-1];
+		const Vector3d& pb = positions[b-1];
+		const Vector3d& pc = positions[c-1];
+		return sign*((pb(u)-pa(u))*(pc(v)-pa(v)) - (pb(v)-pa(v))*(pc(u)-pa(u)));
+	};
+	while(left.size()>3){
+		int m = left.size();
+		int ear = -1;
+		for(int j=1;j<=m && ear<0;j++){
+			int i = j%m;
+			int a = left[(i+m-1)%m], b = left[i], c = left[(i+1)%m];
+			if(turn(a,b,c)<=0)
+				continue;
+			bool blocked = false;
+			for(int k=0;k<m && !blocked;k++){
+				int p = left[k];
+				if(p==a || p==b || p==c)
+					continue;
+				const Vector3d& pp = positions[p-1];
+				if(pp==positions[a-1] || pp==positions[b-1] || pp==positions[c-1])
+					continue;
+				blocked = turn(a,b,p)>=0 && turn(b,c,p)>=0 && turn(c,a,p)>=0;
+			}
+			if(!blocked)
+				ear = i;
+		}
+		if(ear<0)
+			ear = 1%m; // degenerate outline: clip anyway so that it ends
+		int corners[3] = {left[(ear+m-1)%m]-1, left[ear]-1, left[(ear+1)%m]-1};
+		triangles.insert(triangles.end(), corners, corners+3);
+		left.erase(left.begin()+ear);
+	}
+	if(left.size()==3){
+		int corners[3] = {left[0]-1, left[1]-1, left[2]-1};
+		triangles.insert(triangles.end(), corners, corners+3);
+	}
+}
+
+/* Edge-collapse decimation driven by quadric error metrics. Faces with
+   more than three corners are split into triangles first. The cheapest
+   edge is collapsed until the face count reaches the target; queue
+   entries carry the versions of their two vertices so stale ones are
+   skipped when they come up. Collapses that would fold the surface or
+   make it non-manifold (the link condition) are refused. */
+class Mesh_Decimator{
+private:
+	Object_3D& obj;
+	vector<Vector3d> positions;
+	vector<Quadric> quadrics;
+	vector<int> versions;
+	vector<int> merged_into;
+	vector<int> triangles;
+	vector<int> triangle_materials;
+	vector<char> removed;
+	vector< vector<int> > vertex_faces;
+	size_t face_count;
+	double length_weight;
+
+	struct Collapse{
+		double cost;
+		int a, b;
+		int version_a, version_b;
+		Vector3d target;
+
+		bool operator<(const Collapse& other) const{
+			return cost>other.cost;
+		}
+	};
+	priority_queue<Collapse> queue;
+
+	int find(int v){
+		while(merged_into[v]!=v)
+			v = merged_into[v] = merged_into[merged_into[v]];
+		return v;
+	}
+
+	Vector3d getFaceNormal(int t, int moved, const Vector3d& position) const{
+		Vector3d p[3];
+		for(int k=0;k<3;k++){
+			int v = triangles[3*t+k];
+			p[k] = (v==moved) ? position : positions[v];
+		}
+		return (p[1]-p[0]).cross(p[2]-p[0]);
+	}
+
+	void pushEdge(int a, int b){
+		Quadric sum = quadrics[a];
+		sum.add(quadrics[b]);
+		Collapse collapse;
+		collapse.a = a;
+		collapse.b = b;
+		collapse.version_a = versions[a];
+		collapse.version_b = versions[b];
+		if(!sum.getMinimum(collapse.target)){
+			Vector3d candidates[3] = {positions[a], positions[b], (positions[a]+positions[b])/2};
+			collapse.target = candidates[0];
+			for(int i=1;i<3;i++){
+				if(sum.getError(candidates[i])<sum.getError(collapse.target))
+					collapse.target = candidates[i];
+			}
+		}
+		collapse.cost = max(0.0, sum.getError(collapse.target)) +
+			length_weight*(positions[a]-positions[b]).squaredNorm();
+		queue.push(collapse);
+	}
+
+	void getNeighbours(int v, vector<int>& neighbours) const{
+		neighbours.clear();
+		for(size_t i=0;i<vertex_faces[v].size();i++){
+			int t = vertex_faces[v][i];
+			for(int k=0;k<3;k++){
+				if(triangles[3*t+k]!=v)
+					neighbours.push_back(triangles[3*t+k]);
+			}
+		}
+		sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+	}
+
+	/* Moves b onto a at the collapse target, or refuses. */
+	bool collapse(const Collapse& edge){
+		int a = edge.a, b = edge.b;
+		vector<int> shared, neighbours_a, neighbours_b, common;
+		for(size_t i=0;i<vertex_faces[b].size();i++){
+			int t = vertex_faces[b][i];
+			if(triangles[3*t]==a || triangles[3*t+1]==a || triangles[3*t+2]==a)
+				shared.push_back(t);
+		}
+		if(shared.empty() || shared.size()>2)
+			return false;
+
+		// link condition: a and b may only share the corners opposite
+		// their common edge
+		getNeighbours(a, neighbours_a);
+		getNeighbours(b, neighbours_b);
+		set_intersection(neighbours_a.begin(), neighbours_a.end(), neighbours_b.begin(),
+			neighbours_b.end(), back_inserter(common));
+		if(common.size()!=shared.size())
+			return false;
+
+		for(int side=0;side<2;side++){
+			int v = side ? b : a;
+			for(size_t i=0;i<vertex_faces[v].size();i++){
+				int t = vertex_faces[v][i];
+				if(std::find(shared.begin(), shared.end(), t)!=shared.end())
+					continue;
+				Vector3d before = getFaceNormal(t, -1, Vector3d());
+				Vector3d after = getFaceNormal(t, v, edge.target);
+				if(after.norm()==0 || before.dot(after)<DECIMATE_MIN_NORMAL_DOT*before.norm()*after.norm())
+					return false;
+			}
+		}
+
+		for(size_t i=0;i<shared.size();i++){
+			int t = shared[i];
+			removed[t] = 1;
+			face_count--;
+			for(int k=0;k<3;k++){
+				vector<int>& faces = vertex_faces[triangles[3*t+k]];
+				faces.erase(std::find(faces.begin(), faces.end(), t));
+			}
+		}
+		for(size_t i=0;i<vertex_faces[b].size();i++){
+			int t = vertex_faces[b][i];
+			for(int k=0;k<3;k++){
+				if(triangles[3*t+k]==b)
+					triangles[3*t+k] = a;
+			}
+			vertex_faces[a].push_back(t);
+		}
+		vector<int>().swap(vertex_faces[b]);
+		positions[a] = edge.target;
+		quadrics[a].add(quadrics[b]);
+		merged_into[b] = a;
+		versions[a]++;
+		versions[b]++;
+
+		getNeighbours(a, neighbours_a);
+		for(size_t i=0;i<neighbours_a.size();i++)
+			pushEdge(a, neighbours_a[i]);
+		return true;
+	}
+
+public:
+	Mesh_Decimator(Object_3D& obj) : obj(obj){
+		const Vertex_Matrix& vertices = obj.getVertices();
+		const Polygon_List& faces = obj.getFaces();
+		const vector<int>& face_materials = obj.getFaceMaterials();
+		size_t vertex_count = vertices.cols();
+		positions.resize(vertex_count);
+		for(size_t i=0;i<vertex_count;i++)
+			positions[i] = vertices.col(i).template cast<double>();
+		quadrics.resize(vertex_count);
+		versions.assign(vertex_count, 0);
+		merged_into.resize(vertex_count);
+		for(size_t i=0;i<vertex_count;i++)
+			merged_into[i] = i;
+		vertex_faces.resize(vertex_count);
+
+		vector<int> split;
+		for(size_t f=0;f<faces.size();f++){
+			split.clear();
+			triangulate_polygon(faces.polygon(f), faces.corners(f), positions, split);
+			for(size_t t=0;t<split.size();t+=3){
+				const int* corners = &split[t];
+				if(corners[0]==corners[1] || corners[1]==corners[2] || corners[0]==corners[2])
+					continue;
+				triangles.insert(triangles.end(), corners, corners+3);
+				triangle_materials.push_back(face_materials[f]);
+			}
+		}
+		face_count = triangle_materials.size();
+		removed.assign(face_count, 0);
+
+		// face planes, weighted by area, and the edges for the queue
+		vector< pair< pair<int,int>,int> > edges;
+		double area_sum = 0;
+		for(size_t t=0;t<face_count;t++){
+			const int* corners = &triangles[3*t];
+			Vector3d cross = (positions[corners[1]]-positions[corners[0]]).cross(
+				positions[corners[2]]-positions[corners[0]]);
+			double area = cross.norm()/2;
+			area_sum += area;
+			for(int k=0;k<3;k++){
+				vertex_faces[corners[k]].push_back(t);
+				int a = corners[k], b = corners[(k+1)%3];
+				edges.push_back(make_pair(make_pair(min(a,b), max(a,b)), (int) t));
+			}
+			if(area==0)
+				continue;
+			Vector3d normal = cross.normalized();
+			double offset = normal.dot(positions[corners[0]]);
+			for(int k=0;k<3;k++)
+				quadrics[corners[k]].addPlane(normal, offset, area);
+		}
+		sort(edges.begin(), edges.end());
+		length_weight = (face_count>0) ? DECIMATE_LENGTH_WEIGHT*area_sum/face_count : 0;
+
+		// border and material edges
+		for(size_t i=0;i<edges.size();){
+			size_t j = i;
+			while(j<edges.size() && edges[j].first==edges[i].first)
+				j++;
+			bool border = (j-i==1) ||
+				(j-i==2 && triangle_materials[edges[i].second]!=triangle_materials[edges[i+1].second]);
+			if(border){
+				int a = edges[i].first.first, b = edges[i].first.second;
+				for(size_t e=i;e<j;e++){
+					const int* corners = &triangles[3*edges[e].second];
+					Vector3d face_normal = (positions[corners[1]]-positions[corners[0]]).cross(
+						positions[corners[2]]-positions[corners[0]]);
+					Vector3d along = positions[b]-positions[a];
+					Vector3d normal = along.cross(face_normal);
+					if(normal.norm()==0)
+						continue;
+					normal.normalize();
+					double offset = normal.dot(positions[a]);
+					double weight = DECIMATE_BORDER_WEIGHT*along.squaredNorm();
+					quadrics[a].addPlane(normal, offset, weight);
+					quadrics[b].addPlane(normal, offset, weight);
+				}
+			}
+			i = j;
+		}
+		for(size_t i=0;i<edges.size();i++){
+			if(i==0 || edges[i].first!=edges[i-1].first)
+				pushEdge(edges[i].first.first, edges[i].first.second);
+		}
+	}
+
+	/* Collapses edges until at most `target` faces are left, or no edge
+	   can go, and hands the result back to the object. */
+	void decimate(size_t target){
+		while(face_count>target && !queue.empty()){
+			Collapse edge = queue.top();
+			queue.pop();
+			if(edge.version_a!=versions[edge.a] || edge.version_b!=versions[edge.b] ||
+				merged_into[edge.a]!=edge.a || merged_into[edge.b]!=edge.b)
+				continue;
+			collapse(edge);
+		}
+
+		// number the vertices still in use, and the lines through them
+		vector<int> index(positions.size(), 0);
+		vector<Vector3d> used;
+		Polygon_List faces;
+		vector<int> face_materials;
+		for(size_t t=0;t<removed.size();t++){
+			if(removed[t])
+				continue;
+			int corners[3];
+			for(int k=0;k<3;k++){
+				int v = triangles[3*t+k];
+				if(index[v]==0){
+					used.push_back(positions[v]);
+					index[v] = used.size();
+				}
+				corners[k] = index[v];
+			}
+			faces.add(corners, 3);
+			face_materials.push_back(triangle_materials[t]);
+		}
+		const Polygon_List& lines = obj.getEdges();
+		Polygon_List edges;
+		vector<int> line;
+		for(size_t i=0;i<lines.size();i++){
+			line.clear();
+			for(int k=0;k<lines.corners(i);k++){
+				int v = find(lines.polygon(i)[k]-1);
+				if(index[v]==0){
+					used.push_back(positions[v]);
+					index[v] = used.size();
+				}
+				if(line.empty() || line.back()!=index[v])
+					line.push_back(index[v]);
+			}
+			if(line.size()>=2)
+				edges.add(line.data(), line.size());
+		}
+
+		Vertex_Matrix vertices(3, used.size());
+		for(size_t i=0;i<used.size();i++)
+			vertices.col(i) = used[i].cast<Real>();
+		obj.setVertices(vertices);
+		obj.setFaces(faces, face_materials);
+		obj.setEdges(edges);
+		obj.computeFaceNormals();
+		Bsp_Tree none;
+		obj.setBspTree(none);
+		obj.setMerged(false);
+	}
+};
+
+/* Face counts that decimated meshes are made at, about 19% apart, so that
+   nearby requests share one cached level. */
+size_t get_lod_level(size_t target_faces){
+	size_t level = 0;
+	for(int k=0;;k++){
+		size_t next = (size_t) round(pow(2.0, k/4.0));
+		if(next>target_faces)
+			return level;
+		level = next;
+	}
+}
+
+/* Binary mesh cache (.polybin). The file starts with a Polybin_Header,
+   followed by a table of Polybin_Section entries; every section payload
+   is 8 byte aligned so that it can be used in place from the mapping.
+   The source stamp (size, mtime and hash of the OBJ) and the stamps of
+   the material libraries in the DEPS section decide whether the cache
+   is still valid. */
+const char POLYBIN_MAGIC[8] = {'P','O','L','Y','B','I','N','\0'};
+const uint32_t POLYBIN_VERSION = 3;
+
+/* Float and double builds keep their vertices under different tags, so a
+   cache written by one build is refreshed rather than misread by the
+   other. */
+#ifdef SINGLE_PRECISION
+const char POLYBIN_VERTEX_TAG[] = "VRTF";
+const char POLYBIN_NORMAL_TAG[] = "NRMF";
+const char POLYBIN_BSP_VERTEX_TAG[] = "BVTF";
+#else
+const char POLYBIN_VERTEX_TAG[] = "VERT";
+const char POLYBIN_NORMAL_TAG[] = "NORM";
+const char POLYBIN_BSP_VERTEX_TAG[] = "BVRT";
+#endif
+
+struct Polybin_Header{
+	char magic[8];
+	uint32_t version;
+	uint32_t section_count;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+};
+
+struct Polybin_Section{
+	char tag[4];
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+};
+
+uint64_t hash_bytes(const char* data, size_t size){
+	uint64_t hash = 14695981039346656037ULL;
+	size_t words = size/8;
+	for(size_t i=0;i<words;i++){
+		uint64_t word;
+		memcpy(&word, data+8*i, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	for(size_t i=words*8;i<size;i++){
+		hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+	}
+	hash ^= hash >> 29;
+	return hash;
+}
+
+/* A missing file gets size UINT64_MAX so that creating it later
+   invalidates the cache. */
+void get_file_stamp(string filename, uint64_t& size, int64_t& mtime){
+	struct stat info;
+	if(stat(filename.c_str(),&info)!=0){
+		size = UINT64_MAX;
+		mtime = 0;
+		return;
+	}
+	size = info.st_size;
+	mtime = info.st_mtime;
+}
+
+template<typename T>
+void put_value(vector<char>& buffer, T value){
+	const char* bytes = (const char*) &value;
+	buffer.insert(buffer.end(), bytes, bytes+sizeof(T));
+}
+
+void put_string(vector<char>& buffer, const string& str){
+	put_value<uint32_t>(buffer, str.size());
+	buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+template<typename T>
+bool get_value(const char*& p, const char* end, T& value){
+	if((size_t)(end-p)<sizeof(T))
+		return false;
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+}
+
+bool get_string(const char*& p, const char* end, string& str){
+	uint32_t len;
+	if(!get_value(p,end,len) || (size_t)(end-p)<len)
+		return false;
+	str.assign(p, p+len);
+	p += len;
+	return true;
+}
+
+class Polybin_Writer{
+private:
+	vector<Polybin_Section> sections;
+	vector<const char*> payloads;
+
+public:
+	void addSection(const char* tag, const void* data, size_t size){
+		Polybin_Section section;
+		memcpy(section.tag, tag, 4);
+		section.reserved = 0;
+		section.offset = 0;
+		section.size = size;
+		sections.push_back(section);
+		payloads.push_back((const char*) data);
+	}
+
+	bool write(string filename, Polybin_Header header){
+		memcpy(header.magic, POLYBIN_MAGIC, 8);
+		header.version = POLYBIN_VERSION;
+		header.section_count = sections.size();
+		uint64_t offset = sizeof(Polybin_Header) + sections.size()*sizeof(Polybin_Section);
+		for(size_t i=0;i<sections.size();i++){
+			offset = (offset+7) & ~((uint64_t) 7);
+			sections[i].offset = offset;
+			offset += sections[i].size;
+		}
+
+		// write to a temporary name so that readers never see a partial file;
+		// the pid keeps renders of the same mesh in other processes apart
+		string temp_filename = filename + "." + to_string(getpid()) + ".tmp";
+		ofstream file (temp_filename.c_str(), ios::binary);
+		if(!file.is_open())
+			return false;
+		file.write((const char*) &header, sizeof(header));
+		if(!sections.empty())
+			file.write((const char*) &sections[0], sections.size()*sizeof(Polybin_Section));
+		uint64_t position = sizeof(Polybin_Header) + sections.size()*sizeof(Polybin_Section);
+		const char padding[8] = {0,0,0,0,0,0,0,0};
+		for(size_t i=0;i<sections.size();i++){
+			file.write(padding, sections[i].offset-position);
+			if(sections[i].size>0)
+				file.write(payloads[i], sections[i].size);
+			position = sections[i].offset + sections[i].size;
+		}
+		file.close();
+		if(!file || rename(temp_filename.c_str(), filename.c_str())!=0){
+			remove(temp_filename.c_str());
+			return false;
+		}
+		return true;
+	}
+};
+
+class Polybin_Reader{
+private:
+	Mapped_File file;
+	Polybin_Header header;
+	const Polybin_Section* sections;
+
+public:
+	Polybin_Reader(){
+		sections = NULL;
+	}
+
+	bool open(string filename){
+		if(!file.open(filename) || file.length()<sizeof(Polybin_Header))
+			return false;
+		memcpy(&header, file.begin(), sizeof(header));
+		if(memcmp(header.magic, POLYBIN_MAGIC, 8)!=0 || header.version!=POLYBIN_VERSION)
+			return false;
+		uint64_t table_end = sizeof(Polybin_Header) +
+			(uint64_t) header.section_count*sizeof(Polybin_Section);
+		if(table_end>file.length())
+			return false;
+		sections = (const Polybin_Section*) (file.begin()+sizeof(Polybin_Header));
+		for(uint32_t i=0;i<header.section_count;i++){
+			if(sections[i].offset>file.length() ||
+				sections[i].size>file.length()-sections[i].offset)
+				return false;
+		}
+		return true;
+	}
+
+	Polybin_Header& getHeader(){
+		return header;
+	}
+
+	bool getSection(const char* tag, const char*& data, size_t& size){
+		for(uint32_t i=0;i<header.section_count;i++){
+			if(memcmp(sections[i].tag, tag, 4)==0){
+				data = file.begin()+sections[i].offset;
+				size = sections[i].size;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<typename T>
+	bool getArray(const char* tag, const T*& data, size_t& count){
+		const char* bytes;
+		size_t size;
+		if(!getSection(tag, bytes, size) || size%sizeof(T)!=0)
+			return false;
+		data = (const T*) bytes;
+		count = size/sizeof(T);
+		return true;
+	}
+};
+
+/* The mesh with its faces merged by --merge-coplanar is cached apart
+   from the mesh as parsed, so that runs with and without it do not keep
+   replacing each other's cache. */
+string get_cache_filename(string filename, bool merged = false){
+	size_t slash = filename.find_last_of('/');
+	size_t dot = filename.find_last_of('.');
+	if(dot!=string::npos && (slash==string::npos || dot>slash))
+		filename = filename.substr(0,dot);
+	return filename + (merged ? ".merged" : "") + ".polybin";
+}
+
+/* Decimated levels are cached next to the full mesh, one file a level.
+   Levels decimated from merged faces are named apart, since the
+   decimated mesh no longer says what it was made from. */
+string get_lod_cache_filename(string filename, size_t faces, bool merged){
+	string cache_file = get_cache_filename(filename, merged);
+	return cache_file.substr(0, cache_file.size()-8) + ".lod" + to_string(faces) + ".polybin";
+}
+
+bool save_mesh_cache(string cache_file, string filename, Object_3D& obj){
+	Polybin_Header header;
+	get_file_stamp(filename, header.source_size, header.source_mtime);
+	Mapped_File source;
+	if(!source.open(filename))
+		return false;
+	header.source_hash = hash_bytes(source.begin(), source.length());
+	source.close();
+
+	vector<char> deps;
+	const vector<string>& libraries = obj.getMaterialLibraries();
+	put_value<uint32_t>(deps, libraries.size());
+	for(size_t i=0;i<libraries.size();i++){
+		uint64_t size;
+		int64_t mtime;
+		get_file_stamp(libraries[i], size, mtime);
+		put_string(deps, libraries[i]);
+		put_value(deps, size);
+		put_value(deps, mtime);
+	}
+
+	// material table, indexed by the per-face material ids
+	const vector<Material>& materials = obj.getMaterials();
+	vector<char> material_table;
+	put_value<uint32_t>(material_table, materials.size());
+	for(size_t i=0;i<materials.size();i++){
+		const Material& material = materials[i];
+		put_string(material_table, material.get_name());
+		for(int i=0;i<3;i++) put_value(material_table, material.get_ambient()(i));
+		for(int i=0;i<3;i++) put_value(material_table, material.get_diffuse()(i));
+		for(int i=0;i<3;i++) put_value(material_table, material.get_specular()(i));
+		put_value(material_table, material.get_shininess());
+		put_value(material_table, material.get_opacity());
+		put_value<int32_t>(material_table, material.get_illum_no());
+	}
+
+	const Vertex_Matrix& vertices = obj.getVertices();
+	const Polygon_List& faces = obj.getFaces();
+	const Polygon_List& edges = obj.getEdges();
+	const vector<int>& face_materials = obj.getFaceMaterials();
+	const Vertex_Matrix& face_normals = obj.getFaceNormals();
+	vector<uint64_t> face_offsets, edge_offsets;
+	faces.getOffsets(face_offsets);
+	edges.getOffsets(edge_offsets);
+	const vector<int32_t>& face_indices = faces.getIndices();
+	const vector<int32_t>& edge_indices = edges.getIndices();
+
+	Polybin_Writer writer;
+	writer.addSection("DEPS", deps.data(), deps.size());
+	writer.addSection("MATS", material_table.data(), material_table.size());
+	writer.addSection(POLYBIN_VERTEX_TAG, vertices.data(), vertices.size()*sizeof(Real));
+	writer.addSection("FOFF", face_offsets.data(), face_offsets.size()*sizeof(uint64_t));
+	writer.addSection("FIDX", face_indices.data(), face_indices.size()*sizeof(int32_t));
+	writer.addSection("FMAT", face_materials.data(), face_materials.size()*sizeof(int32_t));
+	writer.addSection(POLYBIN_NORMAL_TAG, face_normals.data(), face_normals.size()*sizeof(Real));
+	writer.addSection("EOFF", edge_offsets.data(), edge_offsets.size()*sizeof(uint64_t));
+	writer.addSection("EIDX", edge_indices.data(), edge_indices.size()*sizeof(int32_t));
+	uint32_t merged = obj.isMerged();
+	if(merged)
+		writer.addSection("MRGD", &merged, sizeof(merged));
+
+	// the visibility tree is optional and only stored once it was built
+	const Bsp_Tree& tree = obj.getBspTree();
+	vector<uint64_t> bsp_offsets;
+	if(!tree.empty()){
+		tree.faces.getOffsets(bsp_offsets);
+		writer.addSection("BNOD", tree.nodes.data(), tree.nodes.size()*sizeof(Bsp_Node));
+		writer.addSection("BOFF", bsp_offsets.data(), bsp_offsets.size()*sizeof(uint64_t));
+		writer.addSection("BIDX", tree.faces.getIndices().data(),
+			tree.faces.getIndices().size()*sizeof(int32_t));
+		writer.addSection("BSRC", tree.sources.data(), tree.sources.size()*sizeof(int32_t));
+		writer.addSection(POLYBIN_BSP_VERTEX_TAG, tree.vertices.data(), tree.vertices.size()*sizeof(Real));
+	}
+	return writer.write(cache_file, header);
+}
+
+bool check_dependencies(Polybin_Reader& reader){
+	const char* p;
+	size_t size;
+	if(!reader.getSection("DEPS", p, size))
+		return false;
+	const char* end = p+size;
+	uint32_t count;
+	if(!get_value(p,end,count))
+		return false;
+	for(uint32_t i=0;i<count;i++){
+		string library;
+		uint64_t size, current_size;
+		int64_t mtime, current_mtime;
+		if(!get_string(p,end,library) || !get_value(p,end,size) || !get_value(p,end,mtime))
+			return false;
+		get_file_stamp(library, current_size, current_mtime);
+		if(size!=current_size || mtime!=current_mtime)
+			return false;
+	}
+	return true;
+}
+
+/* Takes the visibility tree from the cache if it has a consistent one. */
+void load_bsp_tree(Polybin_Reader& reader, Object_3D& obj){
+	const Bsp_Node* nodes;
+	const uint64_t* offsets;
+	const int32_t *indices, *sources;
+	const Real* vertices;
+	size_t node_count, offset_count, index_count, source_count, vertex_count;
+	if(!reader.getArray("BNOD", nodes, node_count) ||
+		!reader.getArray("BOFF", offsets, offset_count) ||
+		!reader.getArray("BIDX", indices, index_count) ||
+		!reader.getArray("BSRC", sources, source_count) ||
+		!reader.getArray(POLYBIN_BSP_VERTEX_TAG, vertices, vertex_count))
+		return;
+	if(node_count==0 || offset_count!=source_count+1 || offsets[0]!=0 ||
+		offsets[offset_count-1]!=index_count || vertex_count%3!=0)
+		return;
+	int32_t face_count = obj.getFaces().size();
+	int32_t index_limit = obj.getVertices().cols() + vertex_count/3;
+	for(size_t i=0;i<source_count;i++){
+		if(sources[i]<0 || sources[i]>=face_count || offsets[i]>offsets[i+1])
+			return;
+	}
+	for(size_t i=0;i<index_count;i++){
+		if(indices[i]<1 || indices[i]>index_limit)
+			return;
+	}
+	for(size_t i=0;i<node_count;i++){
+		// children come after their parent, which also rules out cycles
+		if(nodes[i].front>=(int32_t) node_count || nodes[i].back>=(int32_t) node_count ||
+			(nodes[i].front>=0 && nodes[i].front<=(int32_t) i) ||
+			(nodes[i].back>=0 && nodes[i].back<=(int32_t) i) ||
+			(uint64_t) nodes[i].first_face+nodes[i].face_count>source_count)
+			return;
+	}
+
+	Bsp_Tree tree;
+	tree.nodes.assign(nodes, nodes+node_count);
+	tree.faces.assign(indices, index_count, offsets, source_count);
+	tree.sources.assign(sources, sources+source_count);
+	tree.vertices = Map<const Vertex_Matrix>(vertices, 3, vertex_count/3);
+	obj.setBspTree(tree);
+}
+
+bool load_mesh_cache(string cache_file, string filename, Object_3D& obj){
+	Polybin_Reader reader;
+	if(!reader.open(cache_file))
+		return false;
+
+	Polybin_Header& header = reader.getHeader();
+	uint64_t size;
+	int64_t mtime;
+	get_file_stamp(filename, size, mtime);
+	if(size!=header.source_size || mtime!=header.source_mtime)
+		return false;
+	Mapped_File source;
+	if(!source.open(filename) || hash_bytes(source.begin(), source.length())!=header.source_hash)
+		return false;
+	source.close();
+	if(!check_dependencies(reader))
+		return false;
+
+	const char* p;
+	size_t table_size;
+	if(!reader.getSection("MATS", p, table_size))
+		return false;
+	const char* end = p+table_size;
+	uint32_t material_count;
+	if(!get_value(p,end,material_count))
+		return false;
+	if(material_count<1)
+		return false;
+	vector<Material> materials;
+	for(uint32_t i=0;i<material_count;i++){
+		string name;
+		Vector3d ambient, diffuse, specular;
+		double shininess, opacity;
+		int32_t illum_no;
+		bool ok = get_string(p,end,name);
+		for(int j=0;j<3;j++) ok = ok && get_value(p,end,ambient(j));
+		for(int j=0;j<3;j++) ok = ok && get_value(p,end,diffuse(j));
+		for(int j=0;j<3;j++) ok = ok && get_value(p,end,specular(j));
+		ok = ok && get_value(p,end,shininess) && get_value(p,end,opacity) &&
+			get_value(p,end,illum_no);
+		if(!ok)
+			return false;
+		materials.push_back(Material(name, ambient, diffuse, specular, shininess, opacity, illum_no));
+	}
+
+	const Real* vertices;
+	const uint64_t *face_offsets, *edge_offsets;
+	const int32_t *face_indices, *edge_indices, *face_materials;
+	size_t vertex_count, face_offset_count, edge_offset_count;
+	size_t face_index_count, edge_index_count, face_material_count;
+	if(!reader.getArray(POLYBIN_VERTEX_TAG, vertices, vertex_count) ||
+		!reader.getArray("FOFF", face_offsets, face_offset_count) ||
+		!reader.getArray("FIDX", face_indices, face_index_count) ||
+		!reader.getArray("FMAT", face_materials, face_material_count) ||
+		!reader.getArray("EOFF", edge_offsets, edge_offset_count) ||
+		!reader.getArray("EIDX", edge_indices, edge_index_count))
+		return false;
+	if(vertex_count%3!=0 || face_offset_count!=face_material_count+1 || edge_offset_count<1 ||
+		face_offsets[0]!=0 || edge_offsets[0]!=0 ||
+		face_offsets[face_offset_count-1]!=face_index_count ||
+		edge_offsets[edge_offset_count-1]!=edge_index_count)
+		return false;
+	for(size_t i=0;i<face_material_count;i++){
+		if(face_materials[i]<0 || face_materials[i]>=(int32_t) material_count ||
+			face_offsets[i]>face_offsets[i+1])
+			return false;
+	}
+	for(size_t i=0;i+1<edge_offset_count;i++){
+		if(edge_offsets[i]>edge_offsets[i+1])
+			return false;
+	}
+	// the render reads vertex column index-1 for every index
+	int64_t index_limit = vertex_count/3;
+	for(size_t i=0;i<face_index_count;i++){
+		if(face_indices[i]<1 || face_indices[i]>index_limit)
+			return false;
+	}
+	for(size_t i=0;i<edge_index_count;i++){
+		if(edge_indices[i]<1 || edge_indices[i]>index_limit)
+			return false;
+	}
+
+	for(uint32_t i=0;i<material_count;i++){
+		obj.addMaterial(materials[i].get_name(), materials[i]);
+	}
+	Vertex_Matrix points = Map<const Vertex_Matrix>(vertices, 3, vertex_count/3);
+	obj.setVertices(points);
+	Polygon_List faces, edges;
+	edges.assign(edge_indices, edge_index_count, edge_offsets, edge_offset_count-1);
+	faces.assign(face_indices, face_index_count, face_offsets, face_material_count);
+	obj.setEdges(edges);
+	vector<int> materials_of_faces(face_materials, face_materials+face_material_count);
+	obj.setFaces(faces, materials_of_faces);
+
+	// caches written before normals were stored get them recomputed
+	const Real* normals;
+	size_t normal_count;
+	if(reader.getArray(POLYBIN_NORMAL_TAG, normals, normal_count) &&
+		normal_count==3*face_material_count){
+		Vertex_Matrix face_normals = Map<const Vertex_Matrix>(normals, 3, face_material_count);
+		obj.setFaceNormals(face_normals);
+	}
+	else
+		obj.computeFaceNormals();
+	load_bsp_tree(reader, obj);
+	const char* merged;
+	size_t merged_size;
+	obj.setMerged(reader.getSection("MRGD", merged, merged_size));
+	return true;
+}
+
+void print_peak_memory(){
+#ifndef WINDOWS
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF,&usage)==0){
+		// ru_maxrss is in kilobytes on Linux
+		cout<<"Peak memory: "<<usage.ru_maxrss/1024.0<<" MB"<<endl;
+	}
+#endif
+}
+
+double seconds_since(chrono::steady_clock::time_point start){
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+void benchmark_parsers(string filename, string current_dir, int threads){
+	Mapped_File file;
+	if(!file.open(filename))
+		return;
+	double megabytes = file.length()/(1024.0*1024.0);
+	file.close();
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	{
+		Object_3D obj;
+		parse_object_stream(filename, obj, current_dir);
+	}
+	double stream_time = seconds_since(start);
+
+	start = chrono::steady_clock::now();
+	{
+		Object_3D obj;
+		parse_object(filename, obj, current_dir);
+	}
+	double mapped_time = seconds_since(start);
+
+	start = chrono::steady_clock::now();
+	{
+		Object_3D obj;
+		parse_object(filename, obj, current_dir, threads);
+	}
+	double parallel_time = seconds_since(start);
+
+	cout<<"Parse benchmark ("<<megabytes<<" MB):"<<endl;
+	cout<<"  stream parser: "<<stream_time<<" s, "<<megabytes/stream_time<<" MB/s"<<endl;
+	cout<<"  mapped parser: "<<mapped_time<<" s, "<<megabytes/mapped_time<<" MB/s"<<endl;
+	cout<<"  mapped parser, "<<threads<<" threads: "<<parallel_time<<" s, "
+		<<megabytes/parallel_time<<" MB/s"<<endl;
+}
+
+string get_current_directory(string filename) {
+	char buff[FILENAME_MAX];
+	GetCurrentDir( buff, FILENAME_MAX );
+	string current_working_dir(buff);
+	current_working_dir+='/';
+	int index = filename.length()-1;
+	while(index>=0){
+		if(filename[index]=='/')
+			break;
+		index--;
+	}
+	for(int i=0;i<=index;i++){
+		current_working_dir+=filename[i];
+	}
+	return current_working_dir;
+}
+
+
+string get_filename(string str){
+	string filename = "";
+	int index = str.length()-1;
+	while(index>=0){
+		if(str[index]=='/')
+			break;
+		index--;
+	}
+	index++;
+	for(;str[index]!='.';index++)
+		filename += str[index];
+	//cout<<filename<<endl;
+	return (filename);
+}
+
+/* Geometry closer to the eye than this fraction of the eye's distance
+   to the picture plane is clipped away; it would be magnified without
+   bound by the perspective divide. */
+const double NEAR_PLANE_RATIO = 0.05;
+
+/* Parallel projection looks down -z. Perspective projection puts the eye
+   at `eye` (view coordinates relative to the centroid, in output units)
+   and projects onto the plane z=0 through the centroid, so geometry at
+   the depth of the centroid keeps its parallel size. */
+class Projection{
+public:
+	string type;
+	Vector3d eye;
+
+	Projection(){
+		type = PARALLEL;
+		eye = Vector3d(0,0,0);
+	}
+
+	Projection(string type, Vector3d eye){
+		this->type = type;
+		this->eye = eye;
+	}
+
+	bool isPerspective() const{
+		return type == PERSPECTIVE;
+	}
+
+	double getNearPlane() const{
+		return eye(2)*(1-NEAR_PLANE_RATIO);
+	}
+};
+
+vector< pair<string,double> > get_rotations(const string& x, const string& y, const string& z){
+	vector< pair<string,double> > rotations;
+	rotations.push_back(make_pair("x", atof(x.c_str())));
+	rotations.push_back(make_pair("y", atof(y.c_str())));
+	rotations.push_back(make_pair("z", atof(z.c_str())));
+	return rotations;
+}
+
+/* One image of a batch: the rotation triple and the SVG it goes to. An
+   empty filename is derived from the mesh name and `label`. */
+class View{
+public:
+	vector< pair<string,double> > rotations;
+	string label;
+	string filename;
+
+	View(const string& x, const string& y, const string& z, string filename = ""){
+		this->rotations = get_rotations(x,y,z);
+		this->label = x+"_"+y+"_"+z;
+		this->filename = filename;
+	}
+};
+
+/* Reads one view per line: "xdeg ydeg zdeg [output.svg]". Blank lines
+   and lines starting with # are skipped. */
+bool parse_view_manifest(string filename, vector<View>& views){
+	string line;
+	ifstream file (filename.c_str());
+	if(!file.is_open()){
+		cout<<"Unable to open view manifest "<<filename<<endl;
+		return false;
+	}
+	while(getline(file,line)){
+		istringstream iss(line);
+		vector<string> tokens;
+		copy(istream_iterator<string>(iss),
+		     istream_iterator<string>(),
+		     back_inserter(tokens));
+		if(tokens.size()==0 || tokens[0][0]=='#')
+			continue;
+		if(tokens.size()<3){
+			cout<<"Bad view in "<<filename<<": "<<line<<endl;
+			return false;
+		}
+		views.push_back(View(tokens[0], tokens[1], tokens[2],
+			(tokens.size()>3) ? tokens[3] : ""));
+	}
+	return true;
+}
+
+/* Decimals of the SVG coordinates: what to_string has always written,
+   and the most --precision takes. */
+const int SVG_PRECISION = 6;
+const int SVG_MAX_PRECISION = 9;
+
+class Options{
+public:
+	bool bench;
+	bool cache;
+	int threads;
+	bool perspective;
+	Vector3d viewpoint;
+	vector<View> views;
+	bool bsp;
+	bool hsr;
+	bool occlusion;
+	double min_area;
+	bool merge;
+	size_t target_faces;
+	size_t byte_budget;
+	int precision; //decimals of the coordinates, -1 for the default output
+	bool compress;
+	bool batch;
+	bool classes;
+	int color_step;
+
+	Options(){
+		bench = false;
+		cache = true;
+		perspective = false;
+		viewpoint = Vector3d(0,0,0);
+		bsp = false;
+		hsr = false;
+		occlusion = false;
+		min_area = 0;
+		merge = false;
+		target_faces = 0;
+		byte_budget = 0;
+		precision = -1;
+		compress = false;
+		batch = false;
+		classes = false;
+		color_step = 1;
+		threads = thread::hardware_concurrency();
+		if(threads<1)
+			threads = 1;
+	}
+};
+
+/* Reads a count given on the command line; false unless the whole text
+   is a positive integer that fits. */
+bool parse_count(const char* text, size_t& count){
+	if(*text<'0' || *text>'9')
+		return false;
+	char* end;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if(*end!='\0' || errno==ERANGE || value==0 || value>(size_t) -1)
+		return false;
+	count = value;
+	return true;
+}
+
+bool get_options(int argc, char* argv[], Options& options){
+	for(int i=5;i<argc;i++){
+		string arg = argv[i];
+		if(arg == "--bench"){
+			options.bench = true;
+		}
+		else if(arg == "--no-cache"){
+			options.cache = false;
+		}
+		else if(arg == "--bsp"){
+			options.bsp = true;
+		}
+		else if(arg == "--hsr"){
+			options.hsr = true;
+		}
+		else if(arg == "--occlusion"){
+			options.occlusion = true;
+		}
+		else if(arg == "--faces" && i+1<argc){
+			if(!parse_count(argv[++i], options.target_faces)){
+				cout<<"The face count must be a positive integer."<<endl;
+				return false;
+			}
+		}
+		else if(arg == "--budget" && i+1<argc){
+			if(!parse_count(argv[++i], options.byte_budget)){
+				cout<<"The byte budget must be a positive integer."<<endl;
+				return false;
+			}
+		}
+		else if(arg == "--precision" && i+1<argc){
+			options.precision = atoi(argv[++i]);
+			if(options.precision<0 || options.precision>SVG_MAX_PRECISION){
+				cout<<"The precision must be from 0 to "<<SVG_MAX_PRECISION<<" decimals."<<endl;
+				return false;
+			}
+		}
+		else if(arg == "--batch"){
+			options.batch = true;
+		}
+		else if(arg == "--classes"){
+			options.classes = true;
+		}
+		else if(arg == "--color-step" && i+1<argc){
+			options.color_step = atoi(argv[++i]);
+			if(options.color_step<1)
+				options.color_step = 1;
+		}
+		else if(arg == "--svgz"){
+#ifdef SVGZ
+			options.compress = true;
+#else
+			cout<<"This build cannot write .svgz files; build it with SVGZ defined and -lz."<<endl;
+			return false;
+#endif
+		}
+		else if(arg == "--merge-coplanar"){
+			options.merge = true;
+		}
+		else if(arg == "--min-area" && i+1<argc){
+			char* end;
+			options.min_area = strtod(argv[++i],&end);
+			if(end==argv[i] || *end!='\0' || !isfinite(options.min_area) || options.min_area<=0){
+				cout<<"The minimum area must be a number of square pixels greater than 0."<<endl;
+				return false;
+			}
+		}
+		else if(arg == "--threads" && i+1<argc){
+			options.threads = atoi(argv[++i]);
+			if(options.threads<1)
+				options.threads = 1;
+		}
+		else if((arg == "--vx" || arg == "--vy" || arg == "--vz") && i+1<argc){
+			options.perspective = true;
+			options.viewpoint(arg[3]-'x') = strtod(argv[++i],NULL);
+		}
+		else if(arg == "--view" && i+3<argc){
+			options.views.push_back(View(argv[i+1], argv[i+2], argv[i+3]));
+			i += 3;
+		}
+		else if(arg == "--views" && i+1<argc){
+			if(!parse_view_manifest(argv[++i], options.views))
+				return false;
+		}
+		else{
+			cout<<"Unknown option: "<<arg<<endl;
+			return false;
+		}
+	}
+	if(options.perspective && options.viewpoint(2)<=0){
+		cout<<"The viewpoint must be in front of the mesh (--vz > 0)."<<endl;
+		return false;
+	}
+	return true;
+}
+
+void print_usage(char* name){
+	cout<<"usage: "<< name <<" <filename> xdeg ydeg zdeg [options]\n";
+	cout<<"options:\n";
+	cout<<"  --bench        time the stream and mapped OBJ parsers\n";
+	cout<<"  --no-cache     neither read nor write the .polybin mesh cache\n";
+	cout<<"  --bsp          draw in BSP tree order instead of by centroid depth; the\n";
+	cout<<"                 tree is built once and kept in the mesh cache\n";
+	cout<<"  --hsr          clip every face against the faces in front of it and only\n";
+	cout<<"                 write the parts that stay visible\n";
+	cout<<"  --occlusion    drop faces that a coarse depth buffer shows to be covered;\n";
+	cout<<"                 cheaper than --hsr, which it is ignored with\n";
+	cout<<"  --min-area A   merge faces that project to less than A square pixels into\n";
+	cout<<"                 their neighbours (corners move by up to sqrt(A)/2 pixels)\n";
+	cout<<"  --merge-coplanar\n";
+	cout<<"                 merge connected coplanar faces of one material into single\n";
+	cout<<"                 polygons; the merged mesh is kept in its own cache file\n";
+	cout<<"  --faces N      decimate the mesh to at most about N faces first; every\n";
+	cout<<"                 level is kept in its own cache file\n";
+	cout<<"  --budget B     decimate the mesh so the SVG comes to about B bytes\n";
+	cout<<"  --precision N  write coordinates with N decimals (0 for whole pixels)\n";
+	cout<<"                 instead of 6, and give the SVG a viewBox so that it\n";
+	cout<<"                 can be scaled\n";
+	cout<<"  --batch        write runs of opaque faces of one colour that cannot overlap\n";
+	cout<<"                 as a single <path>\n";
+	cout<<"  --classes      give every face style a CSS class in a <style> block\n";
+	cout<<"                 instead of writing it out on every face\n";
+	cout<<"  --color-step S round the face colours to multiples of S, which bounds\n";
+	cout<<"                 the number of styles\n";
+	cout<<"  --svgz         write gzipped .svgz files (builds with SVGZ defined)\n";
+	cout<<"  --threads N    worker threads (default: all cores)\n";
+	cout<<"  --vx X --vy Y --vz Z\n";
+	cout<<"                 perspective view from this viewpoint, in model units\n";
+	cout<<"                 relative to the centre of the rotated mesh\n";
+	cout<<"  --view X Y Z   render another view from the same parse (repeatable)\n";
+	cout<<"  --views FILE   add the views listed in FILE, one \"xdeg ydeg zdeg [out.svg]\"\n";
+	cout<<"                 per line; with several views each SVG is named\n";
+	cout<<"                 <name>_<xdeg>_<ydeg>_<zdeg>.svg unless given\n";
+}
+
+Matrix3d rot_x(Matrix3d matrix, double angle){
+	Matrix3d trans_mat;
+	trans_mat << 	1,     0     ,      0     ,
+					0, cos(angle), -sin(angle),
+					0, sin(angle),  cos(angle);
+	return trans_mat*matrix;
+}
+
+Matrix3d rot_y(Matrix3d matrix, double angle){
+	Matrix3d trans_mat;
+	trans_mat << 	cos(angle),     0     , sin(angle),
+					    0     ,     1     ,     0     ,
+				   -sin(angle),     0     , cos(angle);
+	return trans_mat*matrix;
+}
+
+Matrix3d rot_z(Matrix3d matrix, double angle){
+	Matrix3d trans_mat;
+	trans_mat << 	cos(angle), -sin(angle),    0    ,
+					sin(angle),  cos(angle),    0    ,
+					    0     ,      0     ,    1    ;
+	return trans_mat*matrix;
+}
+
+Matrix3d rotate(Matrix3d matrix, double angle, string axis){
+	if(axis == "x" || axis == "X")
+		matrix = rot_x(matrix,angle);
+	else if(axis == "y" || axis == "Y")
+		matrix = rot_y(matrix, angle);
+	else if(axis == "z" || axis == "Z"){
+		matrix = rot_z(matrix, angle);
 	}
 	return matrix;
 }
 
-Matrix3d get_transfortation_matrix(vector< pair<string,double> >& rotations, double scale){
-	Matrix3d trans_mat = Matrix3d::Identity(3,3);
-	for(int i=0;i<rotations.size();i++){
-		string axis = rotations[i].first;
-		double angle = (rotations[i].second*PI)/180;
-		trans_mat = rotate(trans_mat,angle,axis);
+Matrix3d get_transfortation_matrix(vector< pair<string,double> >& rotations, double scale){
+	Matrix3d trans_mat = Matrix3d::Identity(3,3);
+	for(int i=0;i<rotations.size();i++){
+		string axis = rotations[i].first;
+		double angle = (rotations[i].second*PI)/180;
+		trans_mat = rotate(trans_mat,angle,axis);
+	}
+	return trans_mat*scale;
+}
+
+/* Vertices after the view transform. The columns are stored as
+   transformed and the centroid is subtracted on every read, which keeps
+   the values identical to centering in place without a second pass over
+   the array. */
+template<typename Scalar>
+class Transformed_Vertices{
+public:
+	Vertex_Array<Scalar> points;
+	Vec3<Scalar> center;
+	Vector3d extent;
+
+	size_t size() const{
+		return points.cols();
+	}
+
+	Scalar coord(int k, int i) const{
+		return points(k,i) - center(k);
+	}
+
+	Vec3<Scalar> point(int i) const{
+		return points.col(i) - center;
+	}
+
+	/* Image plane x (k=0) or y (k=1) relative to the centroid. Only a
+	   perspective view fills `projected`; otherwise this is coord(). */
+	Scalar screen(int k, int i) const{
+		return (projected.cols()==0) ? coord(k,i) : projected(k,i);
+	}
+
+	Matrix<Scalar,2,Dynamic,RowMajor> projected;
+};
+
+/* Block size of the fused transform kernel; a block of all three rows
+   stays in L1 between the product and the reduction. */
+const int TRANSFORM_BLOCK = 1024;
+
+/* Transforms the vertices in one streaming pass. Each block is multiplied
+   with the 3x3 matrix (every output row is a packet-vectorized
+   combination of the input rows) and is reduced to the running centroid
+   sum and bounds while it is still in cache. `extent` receives the
+   largest |x|, |y| and |z| relative to the centroid. The centroid sum is
+   accumulated in double whatever the scalar type. */
+template<typename Scalar>
+Transformed_Vertices<Scalar> get_transformed_vertices(const Vertex_Array<Scalar>& vertices,
+	vector< pair<string,double> >& rotations, double scale){
+	Matrix<Scalar,3,3> m = get_transfortation_matrix(rotations,scale).cast<Scalar>();
+	Transformed_Vertices<Scalar> result;
+	size_t n = vertices.cols();
+	result.points.resize(3, n);
+	result.center = Vec3<Scalar>(0,0,0);
+	result.extent = Vector3d(0,0,0);
+	if(n==0)
+		return result;
+
+	Vector3d sum(0,0,0);
+	Vec3<Scalar> min_corner, max_corner;
+	for(size_t first=0;first<n;first+=TRANSFORM_BLOCK){
+		size_t count = min((size_t) TRANSFORM_BLOCK, n-first);
+		for(int k=0;k<3;k++){
+			result.points.row(k).segment(first,count).noalias() =
+				m(k,0)*vertices.row(0).segment(first,count) +
+				m(k,1)*vertices.row(1).segment(first,count) +
+				m(k,2)*vertices.row(2).segment(first,count);
+		}
+		const Scalar* x = result.points.row(0).data() + first;
+		const Scalar* y = result.points.row(1).data() + first;
+		const Scalar* z = result.points.row(2).data() + first;
+		if(first==0){
+			min_corner = max_corner = Vec3<Scalar>(x[0],y[0],z[0]);
+		}
+		for(size_t i=0;i<count;i++){
+			sum(0) += x[i];
+			sum(1) += y[i];
+			sum(2) += z[i];
+			min_corner(0) = min(min_corner(0),x[i]);
+			max_corner(0) = max(max_corner(0),x[i]);
+			min_corner(1) = min(min_corner(1),y[i]);
+			max_corner(1) = max(max_corner(1),y[i]);
+			min_corner(2) = min(min_corner(2),z[i]);
+			max_corner(2) = max(max_corner(2),z[i]);
+		}
+	}
+	result.center = (sum/n).cast<Scalar>();
+	for(int k=0;k<3;k++){
+		result.extent(k) = max(abs(max_corner(k)-result.center(k)),
+			abs(min_corner(k)-result.center(k)));
+	}
+	return result;
+}
+
+/* The viewer in object space as a homogeneous point: the eye under
+   perspective projection, or the direction towards the viewer with w=0
+   under parallel projection. */
+template<typename Scalar>
+Vector4d get_object_viewer(const Transformed_Vertices<Scalar>& points,
+	vector< pair<string,double> >& rotations, double scale, const Projection& projection){
+	Matrix3d m = get_transfortation_matrix(rotations,scale);
+	if(projection.isPerspective()){
+		Vector3d eye = m.inverse()*(projection.eye + points.center.template cast<double>());
+		return Vector4d(eye(0), eye(1), eye(2), 1);
 	}
-	return trans_mat*scale;
+	return Vector4d(m(2,0), m(2,1), m(2,2), 0);
+}
+
+/* Faces that face the viewer, in ascending order. The test runs in
+   object space: the view direction (+z, or the eye under perspective) is
+   taken back through the view matrix once and compared with the
+   precomputed normals, so culled faces never reach depth keying, sorting
+   or normal rotation. Faces without a normal are always dropped. */
+template<typename Scalar>
+vector<int> get_front_faces(const Object_3D& obj, const Transformed_Vertices<Scalar>& points,
+	vector< pair<string,double> >& rotations, double scale,
+	const Projection& projection, bool back_faces){
+	const Vertex_Array<Scalar>& normals = obj.getFaceNormals();
+	const Scalar* nx = normals.row(0).data();
+	const Scalar* ny = normals.row(1).data();
+	const Scalar* nz = normals.row(2).data();
+	vector<int> front;
+	front.reserve(normals.cols()/2+1);
+	if(back_faces){
+		for(int i=0;i<normals.cols();i++){
+			if(nx[i]!=0 || ny[i]!=0 || nz[i]!=0)
+				front.push_back(i);
+		}
+	}
+	else if(projection.isPerspective()){
+		Vector4d viewer = get_object_viewer(points, rotations, scale, projection);
+		Vec3<Scalar> eye = viewer.head<3>().cast<Scalar>();
+		const Polygon_List& faces = obj.getFaces();
+		const Vertex_Array<Scalar>& vertices = obj.getVertices();
+		for(int i=0;i<normals.cols();i++){
+			Vec3<Scalar> to_eye = eye - vertices.col(faces.polygon(i)[0]-1);
+			if(nx[i]*to_eye(0) + ny[i]*to_eye(1) + nz[i]*to_eye(2) > 0)
+				front.push_back(i);
+		}
+	}
+	else{
+		// the view-space z of a rotated normal is its dot product with row 2
+		Matrix<Scalar,3,3> m = get_transfortation_matrix(rotations,1).cast<Scalar>();
+		Scalar dx = m(2,0), dy = m(2,1), dz = m(2,2);
+		for(int i=0;i<normals.cols();i++){
+			if(dx*nx[i] + dy*ny[i] + dz*nz[i] > 0)
+				front.push_back(i);
+		}
+	}
+	return front;
 }
 
-void move_obj_to_center(vector<Vector3d>& vertices, Vector3d obj_cent){
-	for(int i=0;i<vertices.size();i++){
-		vertices[i] -= obj_cent;
+/* Rotates the normals of the listed faces into the view with the
+   rotation part of the view matrix, row by row like the vertex
+   transform. A rotation keeps them unit length. */
+template<typename Scalar>
+Vertex_Array<Scalar> get_rotated_normals(const Vertex_Array<Scalar>& normals,
+	const vector<int>& face_ids, vector< pair<string,double> >& rotations){
+	Matrix<Scalar,3,3> m = get_transfortation_matrix(rotations,1).cast<Scalar>();
+	Vertex_Array<Scalar> gathered(3, face_ids.size());
+	for(size_t i=0;i<face_ids.size();i++){
+		gathered.col(i) = normals.col(face_ids[i]);
+	}
+	Vertex_Array<Scalar> result(3, face_ids.size());
+	for(int k=0;k<3;k++){
+		result.row(k).noalias() = m(k,0)*gathered.row(0) + m(k,1)*gathered.row(1) +
+			m(k,2)*gathered.row(2);
 	}
+	return result;
 }
 
-Vector3d get_object_center(vector<Vector3d>& vertices){
-	Vector3d center(0,0,0);
-	for(int i=0;i<vertices.size();i++){
-		center = center + vertices[i];
+/* Clips the faces against the near plane z = near (view coordinates
+   relative to the centroid), as clip_faces in purupolyhedron_3d.cpp does
+   for its screen plane: the part of a face beyond the plane is cut away
+   and faces entirely beyond it are dropped. The corners created on the
+   plane are appended to `points`. Only the faces in `face_ids` are
+   clipped, and `sources` receives the position in face_ids that every
+   clipped face came from. */
+template<typename Scalar>
+void clip_faces(const Polygon_List& faces, const vector<int>& face_ids,
+	Transformed_Vertices<Scalar>& points, Scalar near,
+	Polygon_List& clipped_faces, vector<int>& sources){
+	vector< Vec3<Scalar> > added;
+	vector<int> clipped_face;
+	int vertex_count = points.size();
+	for(size_t id=0;id<face_ids.size();id++){
+		int j = face_ids[id];
+		const int* face = faces.polygon(j);
+		int n = faces.corners(j);
+		clipped_face.clear();
+		for(int i=0;i<n;i++){
+			Vec3<Scalar> v1 = points.point(face[i]-1);
+			Vec3<Scalar> v2 = points.point(face[(i+1)%n]-1);
+			if((v1(2)>near) && (v2(2)<=near)){
+				Scalar factor = (near-v1(2))/(v2(2)-v1(2));
+				added.push_back(v1 + factor*(v2-v1));
+				added.back()(2) = near;
+				clipped_face.push_back(vertex_count+added.size());
+			}
+			else if((v1(2)<=near) && (v2(2)>near)){
+				Scalar factor = (near-v1(2))/(v2(2)-v1(2));
+				added.push_back(v1 + factor*(v2-v1));
+				added.back()(2) = near;
+				clipped_face.push_back(face[i]);
+				clipped_face.push_back(vertex_count+added.size());
+			}
+			else if((v1(2)<=near) && (v2(2)<=near)){
+				clipped_face.push_back(face[i]);
+			}
+		}
+		if(clipped_face.size()>=3){
+			clipped_faces.add(clipped_face.data(), clipped_face.size());
+			sources.push_back(id);
+		}
 	}
-	if(vertices.size()>0){
-		center = center/(vertices.size());
+	points.points.conservativeResize(3, vertex_count+added.size());
+	for(size_t i=0;i<added.size();i++){
+		points.points.col(vertex_count+i) = added[i] + points.center;
 	}
-	return center;
 }
 
-vector<Vector3d> get_transformed_vertices(vector<Vector3d> vertices,
-	vector< pair<string,double> >& rotations, double scale,
-	pair<string,double>& projection){
-	vector<Vector3d> transformed_vertices;
-	Matrix3d tranformation_matrix = get_transfortation_matrix(rotations,scale);
-	for(int i=0;i<vertices.size();i++){
-		transformed_vertices.push_back(tranformation_matrix*vertices[i]);
+/* Perspective divide onto the picture plane z=0 for an eye at `eye`:
+   x' = ex + (x-ex)*ez/(ez-z), and likewise for y. Works on blocks of
+   vertices with Eigen's array math and fills `projected`. Returns the
+   largest |x'|, |y'| and |z| of the vertices in front of the near plane,
+   which sizes the image. */
+template<typename Scalar>
+Vector3d project_vertices(Transformed_Vertices<Scalar>& points, const Projection& projection){
+	typedef Array<Scalar,1,Dynamic,RowMajor,1,TRANSFORM_BLOCK> Block;
+	Vec3<Scalar> eye = projection.eye.cast<Scalar>();
+	Scalar near = projection.getNearPlane();
+	size_t n = points.size();
+	points.projected.resize(2, n);
+	Vector3d extent(0,0,points.extent(2));
+	for(size_t first=0;first<n;first+=TRANSFORM_BLOCK){
+		size_t count = min((size_t) TRANSFORM_BLOCK, n-first);
+		Block z = points.points.row(2).segment(first,count).array() - points.center(2);
+		Block ratio = eye(2)/(eye(2)-z);
+		for(int k=0;k<2;k++){
+			Block projected = (points.points.row(k).segment(first,count).array() -
+				points.center(k) - eye(k))*ratio + eye(k);
+			points.projected.row(k).segment(first,count) = projected.matrix();
+			Scalar largest = (z<=near).select(projected.abs(), Block::Zero(count)).maxCoeff();
+			extent(k) = max(extent(k), (double) largest);
+		}
+	}
+	return extent;
+}
+
+/* Merges faces of less than `min_area` square pixels into their
+   neighbours. The projected corners are snapped to a grid of
+   sqrt(min_area) pixels, so the corners of such a face mostly land on
+   one or two grid points; the face collapses, and the faces around it
+   stretch over the gap as they share the snapped corners. Collapsed
+   faces are moved from face_ids and mesh_faces to dropped_ids and
+   dropped_mesh_faces. Every corner moves by at most half a grid step. */
+template<typename Scalar>
+void merge_small_faces(const Polygon_List& face_list, vector<int>& face_ids, vector<int>& mesh_faces,
+	Transformed_Vertices<Scalar>& points, double min_area,
+	vector<int>& dropped_ids, vector<int>& dropped_mesh_faces){
+	Scalar step = sqrt(min_area);
+	for(int k=0;k<2;k++){
+		if(points.projected.cols()==0){
+			for(size_t i=0;i<points.size();i++)
+				points.points(k,i) = points.center(k) + step*round(points.coord(k,i)/step);
+		}
+		else{
+			for(size_t i=0;i<points.size();i++)
+				points.projected(k,i) = step*round(points.projected(k,i)/step);
+		}
+	}
+
+	// the area of a polygon on the grid is a multiple of step*step/2
+	size_t kept = 0;
+	for(size_t i=0;i<face_ids.size();i++){
+		const int* face = face_list.polygon(face_ids[i]);
+		int n = face_list.corners(face_ids[i]);
+		double area = 0;
+		for(int k=0;k<n;k++){
+			int a = face[k]-1, b = face[(k+1)%n]-1;
+			area += (double) points.screen(0, a)*points.screen(1, b) -
+				(double) points.screen(0, b)*points.screen(1, a);
+		}
+		if(fabs(area)/2<min_area/4){
+			dropped_ids.push_back(face_ids[i]);
+			dropped_mesh_faces.push_back(mesh_faces[i]);
+		}
+		else{
+			face_ids[kept] = face_ids[i];
+			mesh_faces[kept] = mesh_faces[i];
+			kept++;
+		}
 	}
+	face_ids.resize(kept);
+	mesh_faces.resize(kept);
+}
 
-	Vector3d obj_cent = get_object_center(transformed_vertices);
-	move_obj_to_center(transformed_vertices, obj_cent);
+/* About what write_SVG_poly spends on a triangle at the default
+   precision; used to turn a byte budget into a face count. */
+const size_t SVG_BYTES_PER_FACE = 215;
 
-	return transformed_vertices;
+/* What --classes saves on a face: its style attribute of 128 bytes
+   becomes a class attribute of about 13. */
+const size_t SVG_CLASS_SAVING = 115;
+
+/* SVG_BYTES_PER_FACE for the output `options` ask for. Every decimal a
+   triangle's six coordinates drop saves a byte each, and so does the
+   point once no decimals are left. */
+size_t get_bytes_per_face(const Options& options){
+	size_t bytes = SVG_BYTES_PER_FACE;
+	if(options.classes)
+		bytes -= SVG_CLASS_SAVING;
+	if(options.precision<0)
+		return bytes;
+	int dropped = SVG_PRECISION-options.precision + (options.precision==0 ? 1 : 0);
+	return bytes - 6*dropped;
 }
 
-string get_fill_string(Vector3i fill){
-	string fill_col = "";
-	fill_col += ("rgb("+to_string(fill(0))+","
-					   +to_string(fill(1))+","
-					   +to_string(fill(2))+")");
-	return fill_col;
+double get_angle(Vector3d vector1, Vector3d vector2){
+	return acos(vector1.dot(vector2));
 }
 
-vector<Vector3d> three_diff_vertices(vector<int>& face, vector<Vector3d>& points){
-	Vector3d v1 = points[face[0]-1],v2,v3;
-	vector<Vector3d> vertices;
-	int index = 0;
-	while(index<face.size()){
-		v2 = points[face[index]-1];
-		if(v1==v2){
-			index++;
+template<typename Scalar>
+void get_cent_z(Scalar& sum, const int* face, int n, const Transformed_Vertices<Scalar>& points){
+	sum = 0;
+	for(int i=0;i<n;i++){
+		sum += points.coord(2, face[i] - 1);
+	}
+	sum = sum/n;
+}
+
+template<typename Scalar>
+Vec3<Scalar> get_ele_wise_prod(Vec3<Scalar> a, Vec3<Scalar> b){
+	Vec3<Scalar> c;
+	for(int i=0;i<3;i++){
+		c(i) = a(i)*b(i);
+	}
+	return c;
+}
+
+template<typename Scalar>
+Vector3i get_floor(Vec3<Scalar> a){
+	Vector3i b;
+	for(int i=0;i<3;i++){
+		b(i) = (int)a(i);
+	}
+	return b;
+}
+
+template<typename Scalar>
+Vec3<Scalar> get_half_vector(Vec3<Scalar> a, Vec3<Scalar> b){
+	Vec3<Scalar> c = a + b;
+	c.normalize();
+	return c;
+}
+
+template<typename Scalar>
+Vec3<Scalar> check_color(Vec3<Scalar> color){
+	for(int i=0;i<3;i++){
+		if(color(i)<0)
+			color(i)=0;
+		else if(color(i)>255)
+			color(i)=255;
+	}
+	return color;
+}
+
+template<typename Scalar>
+vector< pair<Scalar,int> > get_z_list(const Polygon_List& faces, const vector<int>& face_ids,
+	const Transformed_Vertices<Scalar>& vertices){
+	vector< pair<Scalar,int> > z_list(face_ids.size());
+	for(size_t j=0;j<face_ids.size();j++){
+		const int* face = faces.polygon(face_ids[j]);
+		int n = faces.corners(face_ids[j]);
+		Scalar sum = 0;
+		for(int i=0;i<n;i++){
+			sum = sum + vertices.coord(2, face[i]-1);
 		}
-		else
+		sum = sum/(Scalar)n;
+		z_list[j] = make_pair(sum,j);
+	}
+	return z_list;
+}
+
+/* Radix digits of the 32-bit depth keys: three passes of 11 bits. */
+const int DEPTH_DIGIT_BITS = 11;
+const int DEPTH_PASSES = 3;
+/* Below this many faces sort() is faster than clearing the histograms. */
+const size_t RADIX_SORT_MIN = 4096;
+
+/* Sorts a z_list from get_z_list into the same order as sort() on the
+   pairs. Depths are quantized over their range to 32-bit keys; that map
+   never decreases, so an LSD radix sort on the keys orders all faces
+   whose keys differ. The radix sort is stable and get_z_list lists the
+   ids in ascending order, so only runs of equal keys are left to order
+   by (depth, id), and those are sorted directly. Digits that are the
+   same in every key are skipped. */
+template<typename Scalar>
+void sort_z_list(vector< pair<Scalar,int> >& z_list){
+	const int BUCKETS = 1<<DEPTH_DIGIT_BITS;
+	size_t n = z_list.size();
+	if(n<RADIX_SORT_MIN){
+		sort(z_list.begin(), z_list.end());
+		return;
+	}
+	double lowest = z_list[0].first, highest = z_list[0].first;
+	for(size_t i=1;i<n;i++){
+		lowest = min(lowest, (double) z_list[i].first);
+		highest = max(highest, (double) z_list[i].first);
+	}
+	double scale = (highest>lowest) ? 4294967295.0/(highest-lowest) : 0;
+
+	vector< pair<uint32_t,int> > items(n), buffer(n);
+	vector<size_t> counts(DEPTH_PASSES*BUCKETS, 0);
+	for(size_t i=0;i<n;i++){
+		uint32_t key = (uint32_t) min((z_list[i].first-lowest)*scale, 4294967295.0);
+		items[i] = make_pair(key, (int) i);
+		for(int pass=0;pass<DEPTH_PASSES;pass++)
+			counts[pass*BUCKETS + ((key>>(pass*DEPTH_DIGIT_BITS)) & (BUCKETS-1))]++;
+	}
+	for(int pass=0;pass<DEPTH_PASSES;pass++){
+		int shift = pass*DEPTH_DIGIT_BITS;
+		size_t* count = &counts[pass*BUCKETS];
+		if(count[(items[0].first>>shift) & (BUCKETS-1)]==n)
+			continue;
+		size_t offset = 0;
+		for(int digit=0;digit<BUCKETS;digit++){
+			size_t c = count[digit];
+			count[digit] = offset;
+			offset += c;
+		}
+		for(size_t i=0;i<n;i++)
+			buffer[count[(items[i].first>>shift) & (BUCKETS-1)]++] = items[i];
+		items.swap(buffer);
+	}
+
+	vector< pair<Scalar,int> > sorted(n);
+	for(size_t i=0;i<n;i++)
+		sorted[i] = z_list[items[i].second];
+	for(size_t first=0;first<n;){
+		size_t last = first+1;
+		while(last<n && items[last].first==items[first].first)
+			last++;
+		if(last-first>1)
+			sort(sorted.begin()+first, sorted.begin()+last);
+		first = last;
+	}
+	z_list.swap(sorted);
+}
+
+/* Times sort() against sort_z_list on copies of z_list and checks that
+   they agree. */
+template<typename Scalar>
+void benchmark_depth_sort(const vector< pair<Scalar,int> >& z_list){
+	vector< pair<Scalar,int> > compared = z_list;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	sort(compared.begin(), compared.end());
+	double compare_time = seconds_since(start);
+
+	vector< pair<Scalar,int> > radix = z_list;
+	start = chrono::steady_clock::now();
+	sort_z_list(radix);
+	double radix_time = seconds_since(start);
+
+	double millions = z_list.size()/1e6;
+	cout<<"Depth sort benchmark ("<<z_list.size()<<" faces):"<<endl;
+	cout<<"  std::sort:  "<<compare_time<<" s, "<<millions/compare_time<<" M faces/s"<<endl;
+	cout<<"  radix sort: "<<radix_time<<" s, "<<millions/radix_time<<" M faces/s"
+		<<((radix==compared) ? "" : " (ORDER DIFFERS)")<<endl;
+}
+
+template<typename Scalar>
+Vector3i get_face_color(const Light& light, const Material& material, const Vec3<Scalar>& normal){
+	int illum_no = material.get_illum_no();
+	Vec3<Scalar> light_position = light.get_position().cast<Scalar>();
+	Vec3<Scalar> light_ambient = light.get_ambient().cast<Scalar>();
+	Vec3<Scalar> light_diffuse = light.get_diffuse().cast<Scalar>();
+	Vec3<Scalar> light_specular = light.get_specular().cast<Scalar>();
+	Vec3<Scalar> material_ambient = material.get_ambient().cast<Scalar>();
+	Vec3<Scalar> material_diffuse = material.get_diffuse().cast<Scalar>();
+	Vec3<Scalar> material_specular = material.get_specular().cast<Scalar>();
+	Vec3<Scalar> color(255,255,255);
+	if(illum_no==0){
+		Vec3<Scalar> diffuse = normal.dot(light_position)*
+			get_ele_wise_prod(light_diffuse,material_diffuse);
+		color = check_color(get_ele_wise_prod(color, diffuse));
+	}
+	else if(illum_no == 1){
+		Vec3<Scalar> ambient = get_ele_wise_prod(light_ambient,material_ambient);
+		Vec3<Scalar> diffuse = normal.dot(light_position)*
+			get_ele_wise_prod(light_diffuse,material_diffuse);
+		color = check_color<Scalar>(ambient+diffuse);
+	}
+	else if(illum_no == 2){
+		Vec3<Scalar> ambient = get_ele_wise_prod(light_ambient,material_ambient);
+		Vec3<Scalar> ambient_color = check_color(get_ele_wise_prod(color, ambient));
+
+		Vec3<Scalar> diffuse = normal.dot(light_position)*
+			get_ele_wise_prod(light_diffuse,material_diffuse);
+		Vec3<Scalar> diffuse_color = check_color(get_ele_wise_prod(color, diffuse));
+
+		Vec3<Scalar> half = get_half_vector(light_position, normal);
+		Vec3<Scalar> specular = (Scalar) pow((normal.dot(half)),(Scalar) material.get_shininess())*
+			get_ele_wise_prod(light_specular,material_specular);
+		Vec3<Scalar> specular_color = check_color(get_ele_wise_prod(color, specular));
+		color = check_color<Scalar>(ambient_color+diffuse_color+specular_color);
+	}
+
+	return get_floor(color);
+}
+
+/* Hidden-surface removal in screen space. The faces are visited front to
+   back, in the reverse of the drawing order, and each one is cut by the
+   opaque convex faces visited before it, found through a grid over the
+   image. What is left is exactly what the painter's algorithm would show
+   of it. */
+const double HSR_EPSILON = 1e-6;	// pixels
+const double HSR_MIN_AREA = 1e-4;	// square pixels
+const double HSR_MIN_CELL = 2;
+const double HSR_MAX_CELL = 64;
+const size_t HSR_MAX_CELLS = 1<<22;
+
+const char FACE_HIDDEN = 0;
+const char FACE_PARTIAL = 1;
+const char FACE_WHOLE = 2;
+
+struct Screen_Point{
+	double x;
+	double y;
+};
+
+/* Edge of an occluder, normal.p = offset, with the normal pointing into
+   the occluder. */
+struct Screen_Line{
+	double nx;
+	double ny;
+	double offset;
+};
+
+/* What hide_surfaces left of every position of the drawing order. A
+   partly covered position owns piece_count[i] pieces from first_piece[i]
+   on, piece k being corners piece_offsets[k] .. piece_offsets[k+1]-1,
+   and segment_count[i] pairs of points from first_segment[i] on: the
+   parts of its own edges that nothing covers. */
+class Visible_Faces{
+public:
+	vector<char> state;
+	vector<size_t> first_piece;
+	vector<size_t> piece_count;
+	vector<size_t> piece_offsets;
+	vector<Screen_Point> corners;
+	vector<size_t> first_segment;
+	vector<size_t> segment_count;
+	vector<Screen_Point> segments;
+	size_t hidden;
+	size_t partial;
+
+	Visible_Faces(){
+		hidden = 0;
+		partial = 0;
+	}
+};
+
+double get_signed_area(const vector<Screen_Point>& polygon){
+	double area = 0;
+	for(size_t i=0;i<polygon.size();i++){
+		const Screen_Point& p = polygon[i];
+		const Screen_Point& q = polygon[(i+1)%polygon.size()];
+		area += p.x*q.y - q.x*p.y;
+	}
+	return area/2;
+}
+
+inline double get_line_distance(const Screen_Line& line, const Screen_Point& p){
+	return line.nx*p.x + line.ny*p.y - line.offset;
+}
+
+/* Edge lines of a polygon, or none when it is degenerate or not convex;
+   only convex faces occlude. */
+bool get_occluder_lines(vector<Screen_Point> polygon, vector<Screen_Line>& lines){
+	double area = get_signed_area(polygon);
+	if(fabs(area)<HSR_MIN_AREA)
+		return false;
+	if(area<0)
+		reverse(polygon.begin(), polygon.end());
+	size_t n = polygon.size(), first = lines.size();
+	for(size_t i=0;i<n;i++){
+		const Screen_Point& a = polygon[i];
+		const Screen_Point& b = polygon[(i+1)%n];
+		const Screen_Point& c = polygon[(i+2)%n];
+		double cross = (b.x-a.x)*(c.y-b.y) - (b.y-a.y)*(c.x-b.x);
+		double length = hypot(b.x-a.x, b.y-a.y);
+		if(cross<-HSR_EPSILON*length){
+			lines.resize(first);
+			return false;
+		}
+		if(length<=0)
+			continue;
+		Screen_Line line;
+		line.nx = -(b.y-a.y)/length;
+		line.ny = (b.x-a.x)/length;
+		line.offset = line.nx*a.x + line.ny*a.y;
+		lines.push_back(line);
+	}
+	return true;
+}
+
+/* Splits a polygon by a line into the part on its inner side and the
+   part on its outer side; corners on the line go to both. */
+void split_polygon(const vector<Screen_Point>& polygon, const Screen_Line& line,
+	vector<Screen_Point>& inside, vector<Screen_Point>& outside){
+	inside.clear();
+	outside.clear();
+	size_t n = polygon.size();
+	for(size_t i=0;i<n;i++){
+		const Screen_Point& p = polygon[i];
+		const Screen_Point& q = polygon[(i+1)%n];
+		double dp = get_line_distance(line, p), dq = get_line_distance(line, q);
+		if(dp>=-HSR_EPSILON)
+			inside.push_back(p);
+		if(dp<=HSR_EPSILON)
+			outside.push_back(p);
+		if((dp>HSR_EPSILON && dq<-HSR_EPSILON) || (dp<-HSR_EPSILON && dq>HSR_EPSILON)){
+			double t = dp/(dp-dq);
+			Screen_Point cut = {p.x + t*(q.x-p.x), p.y + t*(q.y-p.y)};
+			inside.push_back(cut);
+			outside.push_back(cut);
+		}
+	}
+}
+
+/* Cuts a convex occluder out of `polygon` and appends the pieces left
+   outside it to `result`. Returns false, appending nothing, when the two
+   do not overlap, or overlap by less than HSR_MIN_AREA. */
+bool subtract_occluder(const vector<Screen_Point>& polygon, const Screen_Line* lines, size_t n,
+	vector< vector<Screen_Point> >& result){
+	bool covered = true;
+	for(size_t k=0;k<n;k++){
+		bool outside = true;
+		for(size_t i=0;i<polygon.size();i++){
+			double distance = get_line_distance(lines[k], polygon[i]);
+			if(distance>HSR_EPSILON)
+				outside = false;
+			if(distance<-HSR_EPSILON)
+				covered = false;
+		}
+		if(outside)
+			return false;
+	}
+	if(covered)
+		return true;
+
+	size_t first = result.size();
+	double area = fabs(get_signed_area(polygon));
+	vector<Screen_Point> remaining = polygon, inside, outside;
+	for(size_t k=0;k<n && remaining.size()>=3;k++){
+		split_polygon(remaining, lines[k], inside, outside);
+		double outside_area = (outside.size()>=3) ? fabs(get_signed_area(outside)) : 0;
+		if(outside_area>=HSR_MIN_AREA){
+			result.push_back(outside);
+			area -= outside_area;
+		}
+		remaining.swap(inside);
+	}
+	if(area<HSR_MIN_AREA){
+		result.resize(first);
+		return false;
+	}
+	return true;
+}
+
+/* Narrows [t0,t1] to the part of the segment a-b strictly inside a
+   convex occluder; t0>=t1 when there is none. */
+void get_covered_interval(const Screen_Point& a, const Screen_Point& b,
+	const Screen_Line* lines, size_t n, double& t0, double& t1){
+	t0 = 0;
+	t1 = 1;
+	for(size_t k=0;k<n && t0<t1;k++){
+		double da = get_line_distance(lines[k], a), db = get_line_distance(lines[k], b);
+		if(da<=HSR_EPSILON && db<=HSR_EPSILON){
+			t0 = 1;
+			t1 = 0;
+		}
+		else if(da<=HSR_EPSILON)
+			t0 = max(t0, (HSR_EPSILON-da)/(db-da));
+		else if(db<=HSR_EPSILON)
+			t1 = min(t1, (HSR_EPSILON-da)/(db-da));
+	}
+}
+
+/* Works out which part of every face in z_list stays visible; only the
+   positions flagged in `opaque` hide what is behind them. */
+template<typename Scalar>
+Visible_Faces hide_surfaces(const vector< pair<Scalar,int> >& z_list, const Polygon_List& face_list,
+	const vector<int>& face_ids, const Transformed_Vertices<Scalar>& points,
+	const vector<char>& opaque){
+	size_t count = z_list.size();
+	Visible_Faces result;
+	result.state.assign(count, FACE_WHOLE);
+	result.first_piece.assign(count, 0);
+	result.piece_count.assign(count, 0);
+	result.first_segment.assign(count, 0);
+	result.segment_count.assign(count, 0);
+	result.piece_offsets.push_back(0);
+	if(count==0)
+		return result;
+
+	// screen outlines, bounds and occluder edges of every position
+	vector<size_t> outline_offsets(count+1, 0), line_offsets(count+1, 0);
+	vector<Screen_Point> outlines;
+	vector<Screen_Line> lines;
+	vector<double> bounds(4*count);
+	double size_sum = 0;
+	for(size_t i=0;i<count;i++){
+		int face_no = face_ids[z_list[i].second];
+		const int* face = face_list.polygon(face_no);
+		int n = face_list.corners(face_no);
+		double* box = &bounds[4*i];
+		for(int k=0;k<n;k++){
+			Screen_Point p = {(double) points.screen(0, face[k]-1), (double) points.screen(1, face[k]-1)};
+			outlines.push_back(p);
+			box[0] = (k==0) ? p.x : min(box[0], p.x);
+			box[1] = (k==0) ? p.y : min(box[1], p.y);
+			box[2] = (k==0) ? p.x : max(box[2], p.x);
+			box[3] = (k==0) ? p.y : max(box[3], p.y);
+		}
+		outline_offsets[i+1] = outlines.size();
+		size_sum += (box[2]-box[0]) + (box[3]-box[1]);
+		if(opaque[i]){
+			vector<Screen_Point> outline(outlines.begin()+outline_offsets[i], outlines.end());
+			get_occluder_lines(outline, lines);
+		}
+		line_offsets[i+1] = lines.size();
+	}
+
+	// grid cells about twice the size of an average face
+	double min_x = bounds[0], min_y = bounds[1], max_x = bounds[2], max_y = bounds[3];
+	for(size_t i=1;i<count;i++){
+		min_x = min(min_x, bounds[4*i]);
+		min_y = min(min_y, bounds[4*i+1]);
+		max_x = max(max_x, bounds[4*i+2]);
+		max_y = max(max_y, bounds[4*i+3]);
+	}
+	double cell = min(HSR_MAX_CELL, max(HSR_MIN_CELL, size_sum/count));
+	size_t columns, rows;
+	while(true){
+		columns = (size_t) ((max_x-min_x)/cell) + 1;
+		rows = (size_t) ((max_y-min_y)/cell) + 1;
+		if(columns*rows<=HSR_MAX_CELLS)
 			break;
+		cell *= 2;
 	}
-	if(v1 == v2){
-		return vertices;
+	vector< vector<int> > cells(columns*rows);
+
+	vector<int> seen(count, -1), candidates;
+	vector< vector<Screen_Point> > pieces, next;
+	vector< pair<double,double> > covered;
+	for(size_t r=count;r-->0;){
+		int i = r;
+		const double* box = &bounds[4*i];
+		size_t column0 = (size_t) ((box[0]-min_x)/cell), column1 = (size_t) ((box[2]-min_x)/cell);
+		size_t row0 = (size_t) ((box[1]-min_y)/cell), row1 = (size_t) ((box[3]-min_y)/cell);
+		candidates.clear();
+		for(size_t row=row0;row<=row1;row++){
+			for(size_t column=column0;column<=column1;column++){
+				const vector<int>& occluders = cells[row*columns+column];
+				for(size_t c=0;c<occluders.size();c++){
+					int j = occluders[c];
+					if(seen[j]==i)
+						continue;
+					seen[j] = i;
+					const double* other = &bounds[4*j];
+					if(other[0]<box[2] && other[2]>box[0] && other[1]<box[3] && other[3]>box[1])
+						candidates.push_back(j);
+				}
+			}
+		}
+
+		pieces.assign(1, vector<Screen_Point>(outlines.begin()+outline_offsets[i],
+			outlines.begin()+outline_offsets[i+1]));
+		bool cut = false;
+		for(size_t c=0;c<candidates.size() && !pieces.empty();c++){
+			int j = candidates[c];
+			const Screen_Line* occluder = lines.data()+line_offsets[j];
+			size_t n = line_offsets[j+1]-line_offsets[j];
+			next.clear();
+			for(size_t p=0;p<pieces.size();p++){
+				if(subtract_occluder(pieces[p], occluder, n, next))
+					cut = true;
+				else
+					next.push_back(pieces[p]);
+			}
+			pieces.swap(next);
+		}
+
+		if(!cut){
+			result.state[i] = FACE_WHOLE;
+		}
+		else if(pieces.empty()){
+			result.state[i] = FACE_HIDDEN;
+			result.hidden++;
+		}
+		else{
+			result.state[i] = FACE_PARTIAL;
+			result.partial++;
+			result.first_piece[i] = result.piece_offsets.size()-1;
+			result.piece_count[i] = pieces.size();
+			for(size_t p=0;p<pieces.size();p++){
+				result.corners.insert(result.corners.end(), pieces[p].begin(), pieces[p].end());
+				result.piece_offsets.push_back(result.corners.size());
+			}
+
+			// the uncovered parts of the face's own edges keep their outline
+			result.first_segment[i] = result.segments.size()/2;
+			size_t n = outline_offsets[i+1]-outline_offsets[i];
+			for(size_t k=0;k<n;k++){
+				const Screen_Point& a = outlines[outline_offsets[i]+k];
+				const Screen_Point& b = outlines[outline_offsets[i]+(k+1)%n];
+				covered.clear();
+				for(size_t c=0;c<candidates.size();c++){
+					int j = candidates[c];
+					double t0, t1;
+					get_covered_interval(a, b, lines.data()+line_offsets[j],
+						line_offsets[j+1]-line_offsets[j], t0, t1);
+					if(t0<t1)
+						covered.push_back(make_pair(t0, t1));
+				}
+				sort(covered.begin(), covered.end());
+				double t = 0;
+				for(size_t c=0;c<=covered.size();c++){
+					double end = (c<covered.size()) ? covered[c].first : 1;
+					if(end>t){
+						Screen_Point p = {a.x + t*(b.x-a.x), a.y + t*(b.y-a.y)};
+						Screen_Point q = {a.x + end*(b.x-a.x), a.y + end*(b.y-a.y)};
+						result.segments.push_back(p);
+						result.segments.push_back(q);
+					}
+					if(c<covered.size())
+						t = max(t, covered[c].second);
+				}
+			}
+			result.segment_count[i] = result.segments.size()/2-result.first_segment[i];
+		}
+
+		if(line_offsets[i+1]>line_offsets[i]){
+			for(size_t row=row0;row<=row1;row++){
+				for(size_t column=column0;column<=column1;column++)
+					cells[row*columns+column].push_back(i);
+			}
+		}
+	}
+	return result;
+}
+
+/* Conservative occlusion culling on a coarse depth buffer, cheaper than
+   hide_surfaces. Opaque convex faces are rasterized into at most
+   OCCLUSION_RESOLUTION cells a side, and every cell keeps the farthest
+   depth of the nearest face that covers it completely. A face whose
+   footprint only meets cells holding a depth in front of its own
+   nearest corner cannot show and is dropped. Rasterization runs on bands
+   of OCCLUSION_TILE cell rows, one band per task, and the tests read a
+   min pyramid over the cells before scanning small footprints cell by
+   cell. */
+const int OCCLUSION_RESOLUTION = 512;
+const int OCCLUSION_TILE = 32;
+const int OCCLUSION_FINE_CELLS = 64;
+
+/* Min pyramid over the depth cells; level 0 is the buffer itself and
+   cells outside it count as empty. */
+class Depth_Pyramid{
+public:
+	vector< vector<float> > levels;
+	vector<int> columns;
+	vector<int> rows;
+
+	void build(vector<float>& depth, int width, int height){
+		levels.assign(1, vector<float>());
+		levels[0].swap(depth);
+		columns.assign(1, width);
+		rows.assign(1, height);
+		while(columns.back()>1 || rows.back()>1){
+			const vector<float>& fine = levels.back();
+			int fine_columns = columns.back(), fine_rows = rows.back();
+			int coarse_columns = (fine_columns+1)/2, coarse_rows = (fine_rows+1)/2;
+			vector<float> coarse(coarse_columns*coarse_rows);
+			for(int r=0;r<coarse_rows;r++){
+				for(int c=0;c<coarse_columns;c++){
+					float value = numeric_limits<float>::infinity();
+					for(int k=0;k<4;k++){
+						int row = 2*r + k/2, column = 2*c + k%2;
+						value = (row<fine_rows && column<fine_columns) ?
+							min(value, fine[row*fine_columns+column]) : -numeric_limits<float>::infinity();
+					}
+					coarse[r*coarse_columns+c] = value;
+				}
+			}
+			levels.push_back(vector<float>());
+			levels.back().swap(coarse);
+			columns.push_back(coarse_columns);
+			rows.push_back(coarse_rows);
+		}
+	}
+
+	/* Nearest depth that every cell of the block is known to be covered
+	   at. */
+	float getCover(int level, int column0, int row0, int column1, int row1) const{
+		float value = numeric_limits<float>::infinity();
+		const vector<float>& cells = levels[level];
+		for(int r=row0;r<=row1;r++){
+			for(int c=column0;c<=column1;c++)
+				value = min(value, cells[r*columns[level]+c]);
+		}
+		return value;
+	}
+};
+
+/* Marks the positions of z_list whose faces are certainly covered by
+   nearer opaque faces as hidden; see OCCLUSION_RESOLUTION. */
+template<typename Scalar>
+Visible_Faces cull_occluded(const vector< pair<Scalar,int> >& z_list, const Polygon_List& face_list,
+	const vector<int>& face_ids, const Transformed_Vertices<Scalar>& points,
+	const vector<char>& opaque, int threads){
+	size_t count = z_list.size();
+	Visible_Faces result;
+	result.state.assign(count, FACE_WHOLE);
+	if(count==0)
+		return result;
+
+	// screen bounds and depth range of every position
+	vector<float> bounds(4*count), nearest(count), farthest(count);
+	for(size_t i=0;i<count;i++){
+		int face_no = face_ids[z_list[i].second];
+		const int* face = face_list.polygon(face_no);
+		int n = face_list.corners(face_no);
+		float* box = &bounds[4*i];
+		for(int k=0;k<n;k++){
+			float x = points.screen(0, face[k]-1), y = points.screen(1, face[k]-1);
+			float z = points.coord(2, face[k]-1);
+			box[0] = (k==0) ? x : min(box[0], x);
+			box[1] = (k==0) ? y : min(box[1], y);
+			box[2] = (k==0) ? x : max(box[2], x);
+			box[3] = (k==0) ? y : max(box[3], y);
+			nearest[i] = (k==0) ? z : max(nearest[i], z);
+			farthest[i] = (k==0) ? z : min(farthest[i], z);
+		}
+	}
+	float min_x = bounds[0], min_y = bounds[1], max_x = bounds[2], max_y = bounds[3];
+	for(size_t i=1;i<count;i++){
+		min_x = min(min_x, bounds[4*i]);
+		min_y = min(min_y, bounds[4*i+1]);
+		max_x = max(max_x, bounds[4*i+2]);
+		max_y = max(max_y, bounds[4*i+3]);
+	}
+	float cell = max(max_x-min_x, max_y-min_y)/OCCLUSION_RESOLUTION;
+	if(cell<=0)
+		return result;
+	int width = min(OCCLUSION_RESOLUTION, (int) ((max_x-min_x)/cell)+1);
+	int height = min(OCCLUSION_RESOLUTION, (int) ((max_y-min_y)/cell)+1);
+
+	// occluder edges, inside where a*x + b*y + c >= 0 over a whole cell
+	vector<size_t> edge_offsets(count+1, 0);
+	vector<float> edges;
+	int bands = (height+OCCLUSION_TILE-1)/OCCLUSION_TILE;
+	vector< vector<int> > band_faces(bands);
+	for(size_t i=0;i<count;i++){
+		edge_offsets[i+1] = edge_offsets[i];
+		if(!opaque[i])
+			continue;
+		int face_no = face_ids[z_list[i].second];
+		const int* face = face_list.polygon(face_no);
+		int n = face_list.corners(face_no);
+		vector<Screen_Point> outline(n);
+		for(int k=0;k<n;k++){
+			outline[k].x = (points.screen(0, face[k]-1)-min_x)/cell;
+			outline[k].y = (points.screen(1, face[k]-1)-min_y)/cell;
+		}
+		vector<Screen_Line> lines;
+		if(!get_occluder_lines(outline, lines))
+			continue;
+		for(size_t k=0;k<lines.size();k++){
+			// shift the edge in by half a cell diagonal: the test at a cell
+			// centre then holds for the whole cell
+			edges.push_back(lines[k].nx);
+			edges.push_back(lines[k].ny);
+			edges.push_back(-lines[k].offset - 0.5f*(fabs(lines[k].nx)+fabs(lines[k].ny)));
+		}
+		edge_offsets[i+1] = edges.size()/3;
+		const float* box = &bounds[4*i];
+		int band0 = max(0, (int) ((box[1]-min_y)/cell)/OCCLUSION_TILE);
+		int band1 = min(bands-1, (int) ((box[3]-min_y)/cell)/OCCLUSION_TILE);
+		for(int band=band0;band<=band1;band++)
+			band_faces[band].push_back(i);
+	}
+
+	vector<float> depth(width*height, -numeric_limits<float>::infinity());
+	parallel_for(bands, threads, [&](int band){
+		int band_row0 = band*OCCLUSION_TILE, band_row1 = min(height, band_row0+OCCLUSION_TILE)-1;
+		const vector<int>& faces = band_faces[band];
+		for(size_t f=0;f<faces.size();f++){
+			int i = faces[f];
+			const float* box = &bounds[4*i];
+			int column0 = max(0, (int) ((box[0]-min_x)/cell));
+			int column1 = min(width-1, (int) ((box[2]-min_x)/cell));
+			int row0 = max(band_row0, (int) ((box[1]-min_y)/cell));
+			int row1 = min(band_row1, (int) ((box[3]-min_y)/cell));
+			const float* face_edges = &edges[3*edge_offsets[i]];
+			int n = edge_offsets[i+1]-edge_offsets[i];
+			float z = farthest[i];
+			for(int row=row0;row<=row1;row++){
+				float y = row+0.5f;
+				float* cells = &depth[row*width];
+				for(int column=column0;column<=column1;column++){
+					float x = column+0.5f;
+					bool inside = true;
+					for(int k=0;k<n;k++)
+						inside &= (face_edges[3*k]*x + face_edges[3*k+1]*y + face_edges[3*k+2] >= 0);
+					if(inside)
+						cells[column] = max(cells[column], z);
+				}
+			}
+		}
+	});
+
+	Depth_Pyramid pyramid;
+	pyramid.build(depth, width, height);
+
+	const int chunk = 4096;
+	int chunks = (count+chunk-1)/chunk;
+	vector<size_t> hidden(chunks, 0);
+	parallel_for(chunks, threads, [&](int c){
+		size_t end = min(count, (size_t) (c+1)*chunk);
+		for(size_t i=(size_t) c*chunk;i<end;i++){
+			const float* box = &bounds[4*i];
+			int column0 = max(0, (int) ((box[0]-min_x)/cell));
+			int column1 = min(width-1, (int) ((box[2]-min_x)/cell));
+			int row0 = max(0, (int) ((box[1]-min_y)/cell));
+			int row1 = min(height-1, (int) ((box[3]-min_y)/cell));
+			int level = 0;
+			while((column1>>level)-(column0>>level)>1 || (row1>>level)-(row0>>level)>1)
+				level++;
+			bool covered = pyramid.getCover(level, column0>>level, row0>>level,
+				column1>>level, row1>>level) > nearest[i];
+			if(!covered && level>0 && (column1-column0+1)*(row1-row0+1)<=OCCLUSION_FINE_CELLS)
+				covered = pyramid.getCover(0, column0, row0, column1, row1) > nearest[i];
+			if(covered){
+				result.state[i] = FACE_HIDDEN;
+				hidden[c]++;
+			}
+		}
+	});
+	for(int c=0;c<chunks;c++)
+		result.hidden += hidden[c];
+	return result;
+}
+
+/* Size of the buffer an Svg_File gathers output in before writing it. */
+const size_t SVG_BUFFER_SIZE = 1<<20;
+
+/* Output file of a render. Text and numbers are gathered in one buffer
+   that is handed to the file in SVG_BUFFER_SIZE pieces, and numbers are
+   formatted with integer arithmetic instead of a to_string per
+   coordinate. putFixed writes what to_string and "%f" write;
+   putCoordinate rounds to the file's precision, and keeps count of the
+   bytes that saved over SVG_PRECISION decimals. A file that was never
+   opened only counts the bytes it is given. Built with SVGZ, files can
+   also be written gzipped. */
+class Svg_File{
+private:
+	vector<char> buffer;
+	size_t used;
+	size_t flushed;
+	size_t stored;
+	int precision;
+	long long rounding_saved;
+#ifdef WINDOWS
+	ofstream file;
+#else
+	int fd;
+#endif
+#ifdef SVGZ
+	bool compressed;
+	z_stream stream;
+	vector<char> pending;
+	vector<char> deflated;
+	thread compressor;
+#endif
+
+	/* Length of what putFixed(value, decimals) writes, worked out the
+	   same way. */
+	static size_t get_fixed_length(double value, int decimals){
+		static const unsigned long long powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+			10000000, 100000000, 1000000000};
+		unsigned long long power = powers[decimals];
+		double scaled = fabs(value)*power;
+		double whole = floor(scaled);
+		double fraction = scaled-whole;
+		if(!(scaled<1e15) || fabs(fraction-0.5)<=scaled*4e-16)
+			return snprintf(NULL, 0, "%.*f", decimals, value);
+		unsigned long long integral = ((unsigned long long) whole + (fraction>0.5 ? 1 : 0))/power;
+		size_t length = signbit(value) ? 2 : 1;
+		while(integral>=10){
+			integral /= 10;
+			length++;
+		}
+		return decimals>0 ? length+1+decimals : length;
+	}
+
+	char* reserve(size_t n){
+		if(used+n>buffer.size())
+			flush();
+		if(n>buffer.size())
+			buffer.resize(n);
+		return &buffer[used];
+	}
+
+	void store(const char* data, size_t n){
+#ifdef WINDOWS
+		if(file.is_open())
+			file.write(data, n);
+#else
+		size_t done = 0;
+		while(fd>=0 && done<n){
+			ssize_t count = ::write(fd, data+done, n-done);
+			if(count<0 && errno==EINTR)
+				continue;
+			if(count<=0)
+				break;
+			done += count;
+		}
+#endif
+		stored += n;
+	}
+
+#ifdef SVGZ
+	void deflate_chunk(const char* data, size_t n, int mode){
+		stream.next_in = (Bytef*) data;
+		stream.avail_in = n;
+		do{
+			stream.next_out = (Bytef*) &deflated[0];
+			stream.avail_out = deflated.size();
+			::deflate(&stream, mode);
+			store(&deflated[0], deflated.size()-stream.avail_out);
+		}while(stream.avail_out==0);
+	}
+#endif
+
+public:
+	Svg_File(){
+		buffer.resize(SVG_BUFFER_SIZE);
+		used = 0;
+		flushed = 0;
+		stored = 0;
+		precision = SVG_PRECISION;
+		rounding_saved = 0;
+#ifndef WINDOWS
+		fd = -1;
+#endif
+#ifdef SVGZ
+		compressed = false;
+#endif
+	}
+
+	~Svg_File(){
+		close();
+	}
+
+	/* With `compress` the file is written gzipped, as an .svgz. */
+	bool open(string filename, bool compress = false){
+		close();
+		flushed = 0;
+		stored = 0;
+#ifdef WINDOWS
+		file.open(filename.c_str(), ios::binary);
+		if(!file.is_open())
+			return false;
+#else
+		fd = ::open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if(fd<0)
+			return false;
+#endif
+#ifdef SVGZ
+		if(compress){
+			memset(&stream, 0, sizeof(stream));
+			// 16 more window bits ask for a gzip header and trailer
+			if(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8,
+				Z_DEFAULT_STRATEGY)!=Z_OK){
+				close();
+				return false;
+			}
+			pending.resize(SVG_BUFFER_SIZE);
+			deflated.resize(SVG_BUFFER_SIZE/4);
+			compressed = true;
+		}
+#else
+		if(compress){
+			close();
+			return false;
+		}
+#endif
+		return true;
 	}
-	index++;
-	while(index<face.size()){
-		v3 = points[face[index]-1];
-		if((v1==v3) || (v2==v3)){
-			index++;
+
+	/* Hands the buffer to the file. Compressed files deflate it on their
+	   own thread while the next buffer fills. */
+	void flush(){
+#ifdef SVGZ
+		if(compressed){
+			if(compressor.joinable())
+				compressor.join();
+			buffer.swap(pending);
+			if(buffer.size()<SVG_BUFFER_SIZE)
+				buffer.resize(SVG_BUFFER_SIZE);
+			size_t n = used;
+			compressor = thread([this, n](){
+				deflate_chunk(&pending[0], n, Z_NO_FLUSH);
+			});
+			flushed += used;
+			used = 0;
+			return;
 		}
-		else
-			break;
+#endif
+		store(&buffer[0], used);
+		flushed += used;
+		used = 0;
 	}
-	if((v1==v3) || (v2==v3)){
-		return vertices;
+
+	void close(){
+#ifdef SVGZ
+		if(compressed){
+			if(compressor.joinable())
+				compressor.join();
+			deflate_chunk(&buffer[0], used, Z_FINISH);
+			deflateEnd(&stream);
+			compressed = false;
+			flushed += used;
+			used = 0;
+		}
+#endif
+		flush();
+#ifdef WINDOWS
+		if(file.is_open())
+			file.close();
+#else
+		if(fd>=0)
+			::close(fd);
+		fd = -1;
+#endif
 	}
-	vertices.push_back(v1);
-	vertices.push_back(v2);
-	vertices.push_back(v3);
-	return vertices;
-}
 
-Vector3d get_normal(vector<int>& face, vector<Vector3d>& points){
-	Vector3d cross(0,0,0);
-	vector<Vector3d> vertices = three_diff_vertices(face, points);
-	if(vertices.size() == 0)
-		return cross;
-	Vector3d a = vertices[1] - vertices[0];
-	Vector3d b = vertices[2] - vertices[0];
-	cross = a.cross(b);
-	return cross;
-}
+	int getPrecision() const{
+		return precision;
+	}
 
-double get_angle(Vector3d vector1, Vector3d vector2){
-	return acos(vector1.dot(vector2));
-}
+	void setPrecision(int decimals){
+		precision = decimals;
+	}
 
-void get_cent_z(double& sum,vector<int>& face, vector<Vector3d>& points){
-	sum = 0;
-	for(int i=0;i<face.size();i++){
-		sum += points[face[i] - 1](2);
+	/* Bytes the coordinates written so far saved over SVG_PRECISION
+	   decimals; negative when the file is more precise. */
+	long long getRoundingSavings() const{
+		return rounding_saved;
 	}
-	sum = sum/face.size();
-}
 
-Vector3d get_ele_wise_prod(Vector3d a, Vector3d b){
-	Vector3d c;
-	for(int i=0;i<3;i++){
-		c(i) = a(i)*b(i);
+	/* Bytes given to the file so far. */
+	size_t size() const{
+		return flushed+used;
 	}
-	return c;
-}
 
-Vector3i get_floor(Vector3d a){
-	Vector3i b;
-	for(int i=0;i<3;i++){
-		b(i) = (int)a(i);
+	/* Bytes that reached the disk, after compression; complete once the
+	   file is closed. */
+	size_t getStoredSize() const{
+		return stored;
 	}
-	return b;
-}
 
-Vector3d get_half_vector(Vector3d a, Vector3d b){
-	Vector3d c = a + b;
-	c.normalize();
-	return c;
-}
+	void put(const char* text, size_t n){
+		memcpy(reserve(n), text, n);
+		used += n;
+	}
 
-Vector3d check_color(Vector3d color){
-	for(int i=0;i<3;i++){
-		if(color(i)<0)
-			color(i)=0;
-		else if(color(i)>255)
-			color(i)=255;
+	void put(const char* text){
+		put(text, strlen(text));
 	}
-	return color;
-}
 
-vector< pair<double,int> > get_z_list(vector< vector<int> >& faces, vector<Vector3d>& vertices){
-	vector< pair<double,int> > z_list;
-	for(int j=0;j<faces.size();j++){
-		vector<int> face = faces[j];
-		double sum = 0;
-		for(int i=0;i<face.size();i++){
-			sum = sum + vertices[face[i]-1](2);
-		}
-		sum = sum/face.size();
-		z_list.push_back(make_pair(sum,j));
+	void put(const string& text){
+		put(text.data(), text.size());
 	}
-	return z_list;
-}
 
-Vector3i get_face_color(Light& light, Material& material, Vector3d& normal){
-	int illum_no = material.get_illum_no();
-	Vector3d color(255,255,255);
-	if(illum_no==0){
-		Vector3d diffuse = normal.dot(light.get_position())*
-			get_ele_wise_prod(light.get_diffuse(),material.get_diffuse());
-		color = check_color(get_ele_wise_prod(color, diffuse));
+	void put(char c){
+		*reserve(1) = c;
+		used++;
 	}
-	else if(illum_no == 1){
-		Vector3d ambient = get_ele_wise_prod(light.get_ambient(),material.get_ambient());
-		Vector3d ambient_color = check_color(get_ele_wise_prod(color, ambient));
 
-		Vector3d diffuse = normal.dot(light.get_position())*
-			get_ele_wise_prod(light.get_diffuse(),material.get_diffuse());
-		Vector3d diffuse_color = check_color(get_ele_wise_prod(color, diffuse));
+	void putInt(long long value){
+		char* out = reserve(24);
+		unsigned long long magnitude = value<0 ? 0-(unsigned long long)value : value;
+		if(value<0)
+			*out++ = '-';
+		char digits[24];
+		int count = 0;
+		do{
+			digits[count++] = '0' + magnitude%10;
+			magnitude /= 10;
+		}while(magnitude>0);
+		while(count>0)
+			*out++ = digits[--count];
+		used = out-&buffer[0];
+	}
 
-		color = check_color(ambient+diffuse);
+	/* `value` with `decimals` digits after the point, as "%.*f" writes it.
+	   Values whose scaled fraction lies too close to a half for the double
+	   product to decide the rounding, and very large ones, go to snprintf. */
+	void putFixed(double value, int decimals = 6){
+		static const unsigned long long powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+			10000000, 100000000, 1000000000};
+		unsigned long long power = powers[decimals];
+		double scaled = fabs(value)*power;
+		double whole = floor(scaled);
+		double fraction = scaled-whole;
+		if(!(scaled<1e15) || fabs(fraction-0.5)<=scaled*4e-16){
+			char* out = reserve(400);
+			used += snprintf(out, 400, "%.*f", decimals, value);
+			return;
+		}
+		unsigned long long units = (unsigned long long) whole + (fraction>0.5 ? 1 : 0);
+		char* out = reserve(40);
+		if(signbit(value))
+			*out++ = '-';
+		unsigned long long integral = units/power, rest = units%power;
+		char digits[24];
+		int count = 0;
+		do{
+			digits[count++] = '0' + integral%10;
+			integral /= 10;
+		}while(integral>0);
+		while(count>0)
+			*out++ = digits[--count];
+		if(decimals>0){
+			*out++ = '.';
+			for(int i=decimals-1;i>=0;i--){
+				out[i] = '0' + rest%10;
+				rest /= 10;
+			}
+			out += decimals;
+		}
+		used = out-&buffer[0];
 	}
-	else if(illum_no == 2){
-		Vector3d ambient = get_ele_wise_prod(light.get_ambient(),material.get_ambient());
-		Vector3d ambient_color = check_color(get_ele_wise_prod(color, ambient));
 
-		Vector3d diffuse = normal.dot(light.get_position())*
-			get_ele_wise_prod(light.get_diffuse(),material.get_diffuse());
-		Vector3d diffuse_color = check_color(get_ele_wise_prod(color, diffuse));
+	void putCoordinate(double value){
+		if(precision==SVG_PRECISION){
+			putFixed(value, precision);
+			return;
+		}
+		size_t start = size();
+		putFixed(value, precision);
+		rounding_saved += (long long) get_fixed_length(value, SVG_PRECISION) - (long long) (size()-start);
+	}
 
-		Vector3d half = get_half_vector(light.get_position(), normal);
-		Vector3d specular = pow((normal.dot(half)),material.get_shininess())*
-			get_ele_wise_prod(light.get_specular(),material.get_specular());
-		Vector3d specular_color = check_color(get_ele_wise_prod(color, specular));
-		color = check_color(ambient_color+diffuse_color+specular_color);
+	/* `value` as an ostream writes it by default. */
+	void putNumber(double value){
+		char* out = reserve(32);
+		used += snprintf(out, 32, "%g", value);
 	}
 
-	return get_floor(color);
-}
+	void putFill(Vector3i fill){
+		put("rgb(", 4);
+		putInt(fill(0));
+		put(',');
+		putInt(fill(1));
+		put(',');
+		putInt(fill(2));
+		put(')');
+	}
+};
 
-void write_SVG_dot(ofstream& file, Vector3d vertex, Vector3i fill){
+void write_SVG_dot(Svg_File& file, Vector3d vertex, Vector3i fill){
 	double delta_x = (double) (IMG_WIDTH/2);
 	double delta_y = (double)(IMG_HEIGHT/2);
 
 	double cx = delta_x+vertex[0], cy = delta_y+vertex[1];
-	string fill_col = get_fill_string(fill);
-	file<<"<circle cx=\""<<cx<<"\" cy=\""<<cy<<"\" r=\"2\""
-		<<" style=\"stroke:rgb(0,0,0);stroke-width:1;fill:"<<fill_col
-		<<";stroke-opacity:1;fill-opacity:1\"/>"<<endl;
+	file.put("<circle cx=\"");
+	file.putNumber(cx);
+	file.put("\" cy=\"");
+	file.putNumber(cy);
+	file.put("\" r=\"2\" style=\"stroke:rgb(0,0,0);stroke-width:1;fill:");
+	file.putFill(fill);
+	file.put(";stroke-opacity:1;fill-opacity:1\"/>\n");
 }
 
-void write_SVG_header(ofstream& file, string title) {
-  file << "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>" << endl
-       << "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.0//EN\"" << endl
-       << " \"http://www.w3.org/TR/2001/REC-SVG-20010904/DTD/svg10.dtd\">" << endl
-       << "<svg width=\"" << IMG_WIDTH
-       << "\" height=\"" << IMG_HEIGHT <<"\"" << endl
-       << "xmlns=\"http://www.w3.org/2000/svg\" "
-       << "xmlns:xlink= \"http://www.w3.org/1999/xlink\">" <<endl
-       << "<title>"<<title<<"</title>" << endl;
+/* With `view_box` the document gets a viewBox over the image, so that
+   viewers can scale it to any size. */
+void write_SVG_header(Svg_File& file, string title, bool view_box = false) {
+	file.put("<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n"
+		"<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.0//EN\"\n"
+		" \"http://www.w3.org/TR/2001/REC-SVG-20010904/DTD/svg10.dtd\">\n"
+		"<svg width=\"");
+	file.putInt(IMG_WIDTH);
+	file.put("\" height=\"");
+	file.putInt(IMG_HEIGHT);
+	if(view_box){
+		file.put("\" viewBox=\"0 0 ");
+		file.putInt(IMG_WIDTH);
+		file.put(' ');
+		file.putInt(IMG_HEIGHT);
+	}
+	file.put("\"\nxmlns=\"http://www.w3.org/2000/svg\" "
+		"xmlns:xlink= \"http://www.w3.org/1999/xlink\">\n<title>");
+	file.put(title);
+	file.put("</title>\n");
 }
 
-void write_SVG_footer(ofstream& file){
-	file << "</svg>" << endl;
+void write_SVG_footer(Svg_File& file){
+	file.put("</svg>\n");
 }
 
-void remove_duplicates(vector< vector<int> >& list){
-	vector< vector<int> > new_list;
-	map<vector<int>,bool> entries;
+/* Keeps the first occurrence of every edge, in order of appearance. */
+void remove_duplicates(vector< pair<int,int> >& list){
+	vector< pair< pair<int,int>,int> > entries(list.size());
 	for(int i=0;i<list.size();i++){
-		vector<int> edge = list[i];
-		if(entries.find(edge)==entries.end()){
-			entries[edge] = true;
-			new_list.push_back(edge);
-		}
+		entries[i] = make_pair(list[i],i);
+	}
+	sort(entries.begin(),entries.end());
+	vector<int> firsts;
+	for(size_t i=0;i<entries.size();i++){
+		if(i==0 || entries[i].first!=entries[i-1].first)
+			firsts.push_back(entries[i].second);
+	}
+	sort(firsts.begin(),firsts.end());
+	for(size_t i=0;i<firsts.size();i++){
+		list[i] = list[firsts[i]];
 	}
-	list = new_list;
+	list.resize(firsts.size());
 }
 
-vector< vector<int> > make_edge_list(vector< vector<int> >& face_list){
-	vector< vector<int> > edge_list;
+Polygon_List make_edge_list(const Polygon_List& face_list){
+	vector< pair<int,int> > edges;
 	for(int i=0;i<face_list.size();i++){
-		int edges = face_list[i].size();
-		for(int j=0;j<edges;j++){
-			vector<int> new_edge;
-			int vertex1 = face_list[i][j];
-			int vertex2 = face_list[i][(j+1)%edges];
-			if(vertex1<vertex2){
-				new_edge.push_back(vertex1);
-				new_edge.push_back(vertex2);
-			}
-			else{
-				new_edge.push_back(vertex2);
-				new_edge.push_back(vertex1);
-			}
-			edge_list.push_back(new_edge);
+		const int* face = face_list.polygon(i);
+		int n = face_list.corners(i);
+		for(int j=0;j<n;j++){
+			int vertex1 = face[j];
+			int vertex2 = face[(j+1)%n];
+			if(vertex1<vertex2)
+				edges.push_back(make_pair(vertex1,vertex2));
+			else
+				edges.push_back(make_pair(vertex2,vertex1));
 		}
 	}
-	remove_duplicates(edge_list);
+	remove_duplicates(edges);
+	Polygon_List edge_list;
+	edge_list.reserve(edges.size(), 2*edges.size());
+	for(size_t i=0;i<edges.size();i++){
+		int edge[2] = {edges[i].first, edges[i].second};
+		edge_list.add(edge,2);
+	}
 	return edge_list;
 }
 
-void write_SVG_line(ofstream& file, Vector3d p1, Vector3d p2, double stroke_opacity){
+void write_SVG_line(Svg_File& file, Vector3d p1, Vector3d p2, double stroke_opacity){
 	double delta_x = (double) (IMG_WIDTH/2);
 	double delta_y = (double)(IMG_HEIGHT/2);
 	double x1 = delta_x + p1(0), y1 = delta_y + p1(1);
 	double x2 = delta_x + p2(0), y2 = delta_y + p2(1);
 
-	file<<"<line x1=\""<<x1<<"\" y1=\""<<y1<<"\" x2=\""<<x2<<"\" y2=\""<<y2
-		<<"\" style=\"stroke:rgb(0,0,0);stroke-width:2;stroke-opacity:"
-		<<to_string(stroke_opacity)<<";"<<"stroke-linecap:round;\" />"<<endl;
+	file.put("<line x1=\"");
+	file.putNumber(x1);
+	file.put("\" y1=\"");
+	file.putNumber(y1);
+	file.put("\" x2=\"");
+	file.putNumber(x2);
+	file.put("\" y2=\"");
+	file.putNumber(y2);
+	file.put("\" style=\"stroke:rgb(0,0,0);stroke-width:2;stroke-opacity:");
+	file.putFixed(stroke_opacity);
+	file.put(";stroke-linecap:round;\" />\n");
 }
 
-void write_edges(ofstream& file,vector< vector<int> >& edge_list,
-	vector<Vector3d>& points, double stroke_opacity){
+template<typename Scalar>
+void write_edges(Svg_File& file, const Polygon_List& edge_list,
+	const Transformed_Vertices<Scalar>& points, double stroke_opacity){
 	for(int i=0;i<edge_list.size();i++){
-		vector<int> edge = edge_list[i];
-		Vector3d point_1 = points[edge[0]-1];
-		Vector3d point_2 = points[edge[1]-1];
+		const int* edge = edge_list.polygon(i);
+		Vector3d point_1(points.screen(0, edge[0]-1), points.screen(1, edge[0]-1), 0);
+		Vector3d point_2(points.screen(0, edge[1]-1), points.screen(1, edge[1]-1), 0);
 		write_SVG_line(file, point_1, point_2, stroke_opacity);
 	}
 }
@@ -764,140 +4388,705 @@ Vector3i get_darkened_color(Vector3i fill_col, double factor){
 	return fill_col;
 }
 
-void set_image_dimension(vector<Vector3d>& vertices){
-	if(vertices.size()>0){
-		double max_x = vertices[0](0), max_y = vertices[0](1);
-		double min_x = vertices[0](0), min_y = vertices[0](1);
-		for(int i=0;i<vertices.size();i++){
-			Vector3d vertex = vertices[i];
-			if(max_x<abs(vertex(0)))
-				max_x = abs(vertex(0));
-			if(max_y<abs(vertex(1)))
-				max_y = abs(vertex(1));
+void set_image_dimension(const Vector3d& extent){
+	double max_x = extent(0), max_y = extent(1);
+	IMG_WIDTH = 2*max_x + 100*(1-pow(2,max_x/(-100)));
+	IMG_HEIGHT = 2*max_y + 100*(1-pow(2,max_y/(-100)));
+}
+
+/* The face styles of a drawing. Every fill channel is rounded to a
+   multiple of the colour step, which bounds the palette. With classes,
+   collect() gathers the distinct (fill, fill-opacity) pairs the faces
+   use and the most used get the shortest names; write() then puts one
+   CSS rule per pair, and the stroke shared by all faces, in a <style>
+   block, and a face's <path> only names its class. Each class written
+   is counted, so that getSavedBytes() can tell what writing the styles
+   out would have added. */
+class Face_Styles{
+private:
+	int color_step;
+	bool classes;
+	double stroke_opacity;
+	map< pair< array<int,3>, double>, size_t> ids;
+	vector< pair< array<int,3>, double> > styles;
+	vector<size_t> counts;
+	vector<size_t> savings;
+	mutable vector<size_t> uses;
+
+	static pair< array<int,3>, double> get_key(Vector3i fill, double fill_opacity){
+		array<int,3> color = {{fill(0), fill(1), fill(2)}};
+		return make_pair(color, fill_opacity);
+	}
+
+	static Vector3i get_fill(const array<int,3>& color){
+		return Vector3i(color[0], color[1], color[2]);
+	}
+
+	static void put_class(Svg_File& file, size_t id){
+		file.put("Z\" class=\"c");
+		file.putInt(id);
+		file.put("\" />\n");
+	}
+
+public:
+	Face_Styles(int color_step = 1, bool classes = false, double stroke_opacity = 1){
+		this->color_step = color_step;
+		this->classes = classes;
+		this->stroke_opacity = stroke_opacity;
+	}
+
+	bool hasClasses() const{
+		return classes;
+	}
+
+	size_t size() const{
+		return styles.size();
+	}
+
+	Vector3i getFill(Vector3i fill) const{
+		if(color_step<=1)
+			return fill;
+		for(int k=0;k<3;k++)
+			fill(k) = min(255, (fill(k)+color_step/2)/color_step*color_step);
+		return fill;
+	}
+
+	void add(Vector3i fill, double fill_opacity){
+		pair< array<int,3>, double> key = get_key(fill, fill_opacity);
+		map< pair< array<int,3>, double>, size_t>::iterator found = ids.find(key);
+		if(found==ids.end()){
+			ids[key] = styles.size();
+			styles.push_back(key);
+			counts.push_back(1);
 		}
+		else
+			counts[found->second]++;
+	}
 
-		IMG_WIDTH = 2*max_x + 100*(1-pow(2,max_x/(-100)));
-		IMG_HEIGHT = 2*max_y + 100*(1-pow(2,max_y/(-100)));
+	/* Numbers the styles added so far by how often they were used. */
+	void sort(){
+		vector< pair<size_t,size_t> > order(styles.size());
+		for(size_t i=0;i<styles.size();i++)
+			order[i] = make_pair(counts[i], i);
+		std::sort(order.begin(), order.end(), [](const pair<size_t,size_t>& a, const pair<size_t,size_t>& b){
+			return a.first>b.first || (a.first==b.first && a.second<b.second);
+		});
+		vector< pair< array<int,3>, double> > sorted(styles.size());
+		vector<size_t> sorted_counts(styles.size());
+		for(size_t i=0;i<order.size();i++){
+			sorted[i] = styles[order[i].second];
+			sorted_counts[i] = order[i].first;
+			ids[sorted[i]] = i;
+		}
+		styles.swap(sorted);
+		counts.swap(sorted_counts);
+		savings.assign(styles.size(), 0);
+		uses.assign(styles.size(), 0);
+		for(size_t i=0;i<styles.size();i++){
+			Svg_File inline_style, class_name;
+			writeInline(inline_style, get_fill(styles[i].first), styles[i].second, stroke_opacity);
+			put_class(class_name, i);
+			savings[i] = inline_style.size()-class_name.size();
+		}
 	}
-}
 
-void write_SVG_poly(ofstream& file, vector<int>& face,
-	vector<Vector3d>& points, Vector3i fill,double fill_opacity,
-	double stroke_opacity){
+	/* Index of the class of an added style. */
+	size_t find(Vector3i fill, double fill_opacity) const{
+		return ids.find(get_key(fill, fill_opacity))->second;
+	}
+
+	/* Closes a face's path data with its style written out. */
+	static void writeInline(Svg_File& file, Vector3i fill, double fill_opacity, double stroke_opacity){
+		file.put("Z\" style=\"stroke:rgb(0,0,0);stroke-width:1;stroke-linejoin:round;stroke-opacity:");
+		file.putFixed(stroke_opacity);
+		file.put(";fill:");
+		file.putFill(fill);
+		file.put(";fill-opacity:");
+		file.putFixed(fill_opacity);
+		file.put("\" />\n");
+	}
+
+	/* Closes a face's path data with the class of an added style. */
+	void writeClass(Svg_File& file, Vector3i fill, double fill_opacity) const{
+		size_t id = find(fill, fill_opacity);
+		uses[id]++;
+		put_class(file, id);
+	}
+
+	/* Bytes the classes written so far saved over inline styles. */
+	size_t getSavedBytes() const{
+		size_t saved = 0;
+		for(size_t i=0;i<uses.size();i++)
+			saved += uses[i]*savings[i];
+		return saved;
+	}
+
+	void write(Svg_File& file) const{
+		file.put("<style type=\"text/css\"><![CDATA[\npath{stroke:rgb(0,0,0);stroke-width:1;"
+			"stroke-linejoin:round;stroke-opacity:");
+		file.putFixed(stroke_opacity);
+		file.put("}\n");
+		for(size_t i=0;i<styles.size();i++){
+			file.put(".c");
+			file.putInt(i);
+			file.put("{fill:rgb(");
+			file.putInt(styles[i].first[0]);
+			file.put(',');
+			file.putInt(styles[i].first[1]);
+			file.put(',');
+			file.putInt(styles[i].first[2]);
+			file.put(");fill-opacity:");
+			file.putFixed(styles[i].second);
+			file.put("}\n");
+		}
+		file.put("]]></style>\n");
+	}
+};
+
+/* The corners of a face as path data, without the closing Z. */
+template<typename Scalar>
+void write_SVG_outline(Svg_File& file, const int* face, int n,
+	const Transformed_Vertices<Scalar>& points){
 	double delta_x = (double) (IMG_WIDTH/2);
 	double delta_y = (double)(IMG_HEIGHT/2);
-	string str = "<path d=\"";
-	for(int i=0;i<face.size();i++){
-		if(i==0)
-			str += "M ";
-		else
-			str += "L ";
-		double x = delta_x + points[face[i]-1](0), y = delta_y - points[face[i]-1](1);
-		str += to_string(x)+" "+to_string(y)+" ";
+	for(int i=0;i<n;i++){
+		file.put(i==0 ? "M " : "L ", 2);
+		double x = delta_x + points.screen(0, face[i]-1), y = delta_y - points.screen(1, face[i]-1);
+		file.putCoordinate(x);
+		file.put(' ');
+		file.putCoordinate(y);
+		file.put(' ');
 	}
-	string fill_col = get_fill_string(fill);
-	str +="Z\"";
-	str += " style=\"stroke:rgb(0,0,0);stroke-width:1;stroke-linejoin:round;";
-	str	+="stroke-opacity:"+ to_string(stroke_opacity)+";fill:";
-	//str += " style=\"stroke:None;fill:";
-	str += (fill_col);
-	str +=";fill-opacity:"+to_string(fill_opacity)+"\" />\n";
-	file.write(str.c_str(),str.length());
 }
 
-void write_faces(ofstream& file, vector< pair<double,int> >& z_list,
-	vector< vector<int> >& face_list, vector<Vector3d>& points,
-	map<vector<int>,string>& material_name_of_faces, map<string,Material>& materials,
-	Light& light, bool back_faces, double stroke_opacity){
+/* Closes the path data of a face's <path> and writes its style, or its
+   class when `styles` has classes. */
+void write_SVG_style(Svg_File& file, Vector3i fill, double fill_opacity, double stroke_opacity,
+	const Face_Styles* styles = NULL){
+	if(styles && styles->hasClasses())
+		styles->writeClass(file, fill, fill_opacity);
+	else
+		Face_Styles::writeInline(file, fill, fill_opacity, stroke_opacity);
+}
 
-	for(int i=0;i<z_list.size();i++){
-		//cout<<"Face: "<<i<<endl;
-		pair<double,int> face_data = z_list[i];
-		int face_no = face_data.second;
-		vector<int> face = face_list[face_no];
+template<typename Scalar>
+void write_SVG_poly(Svg_File& file, const int* face, int n,
+	const Transformed_Vertices<Scalar>& points, Vector3i fill,double fill_opacity,
+	double stroke_opacity, const Face_Styles* styles = NULL){
+	file.put("<path d=\"", 9);
+	write_SVG_outline(file, face, n, points);
+	write_SVG_style(file, fill, fill_opacity, stroke_opacity, styles);
+}
 
-		Material face_material = materials[material_name_of_faces[face]];
-		Vector3d face_norm = get_normal(face,points);
+/* Writes what hide_surfaces left of a partly covered face: its pieces,
+   stroked in their own colour when opaque so that the cuts between them
+   do not show, then the uncovered parts of its edges in black. */
+void write_SVG_fragments(Svg_File& file, const Visible_Faces& visible, size_t position,
+	Vector3i fill, double fill_opacity, double stroke_opacity){
+	double delta_x = (double) (IMG_WIDTH/2);
+	double delta_y = (double)(IMG_HEIGHT/2);
+	file.put("<path d=\"");
+	size_t first = visible.first_piece[position];
+	for(size_t p=first;p<first+visible.piece_count[position];p++){
+		for(size_t k=visible.piece_offsets[p];k<visible.piece_offsets[p+1];k++){
+			const Screen_Point& corner = visible.corners[k];
+			file.put((k==visible.piece_offsets[p]) ? "M " : "L ");
+			file.putCoordinate(delta_x + corner.x);
+			file.put(' ');
+			file.putCoordinate(delta_y - corner.y);
+			file.put(' ');
+		}
+		file.put("Z ");
+	}
+	file.put("\" style=\"");
+	if(fill_opacity>=1){
+		file.put("stroke:");
+		file.putFill(fill);
+		file.put(";stroke-width:1;stroke-linejoin:round;");
+	}
+	else
+		file.put("stroke:none;");
+	file.put("fill:");
+	file.putFill(fill);
+	file.put(";fill-opacity:");
+	file.putFixed(fill_opacity);
+	file.put("\" />\n");
 
-		if(face_norm == Vector3d(0,0,0)){
-			continue;
+	size_t segments = visible.segment_count[position];
+	if(segments>0){
+		file.put("<path d=\"");
+		first = visible.first_segment[position];
+		for(size_t s=first;s<first+segments;s++){
+			const Screen_Point& a = visible.segments[2*s];
+			const Screen_Point& b = visible.segments[2*s+1];
+			file.put("M ");
+			file.putCoordinate(delta_x + a.x);
+			file.put(' ');
+			file.putCoordinate(delta_y - a.y);
+			file.put(" L ");
+			file.putCoordinate(delta_x + b.x);
+			file.put(' ');
+			file.putCoordinate(delta_y - b.y);
+			file.put(' ');
 		}
-		if(back_faces || face_norm(2)>0){
-			face_norm.normalize();
+		file.put("\" style=\"stroke:rgb(0,0,0);stroke-width:1;stroke-linecap:round;stroke-opacity:");
+		file.putFixed(stroke_opacity);
+		file.put(";fill:none\" />\n");
+	}
+}
+
+/* Most faces one <path> of --batch takes; bounds the overlap tests. */
+const size_t SVG_BATCH_FACES = 64;
+/* Distance on screen that faces without a common corner keep to share a
+   <path>; the round strokes reach half a pixel past every outline. */
+const double SVG_BATCH_GAP = 1;
 
-			Vector3i fill = get_face_color(light, face_material, face_norm);
-			write_SVG_poly(file, face, points, fill, face_material.get_opacity(), stroke_opacity);
+/* Whether an edge of one of the two faces separates them on screen by at
+   least `gap` pixels. Such an edge proves them apart even when a face is
+   not convex; not finding one only means they may overlap. */
+template<typename Scalar>
+bool are_separated(const int* a, int na, const int* b, int nb,
+	const Transformed_Vertices<Scalar>& points, double gap){
+	for(int side=0;side<2;side++){
+		const int* face = (side==0) ? a : b;
+		int n = (side==0) ? na : nb;
+		for(int j=0;j<n;j++){
+			int p = face[j]-1, q = face[(j+1)%n]-1;
+			double nx = points.screen(1,q) - points.screen(1,p);
+			double ny = points.screen(0,p) - points.screen(0,q);
+			double length = sqrt(nx*nx + ny*ny);
+			if(length<=0)
+				continue;
+			double min_a = INFINITY, max_a = -INFINITY, min_b = INFINITY, max_b = -INFINITY;
+			for(int k=0;k<na;k++){
+				double d = (nx*points.screen(0,a[k]-1) + ny*points.screen(1,a[k]-1))/length;
+				min_a = min(min_a, d);
+				max_a = max(max_a, d);
+			}
+			for(int k=0;k<nb;k++){
+				double d = (nx*points.screen(0,b[k]-1) + ny*points.screen(1,b[k]-1))/length;
+				min_b = min(min_b, d);
+				max_b = max(max_b, d);
+			}
+			if(max_a+gap<=min_b || max_b+gap<=min_a)
+				return true;
 		}
 	}
+	return false;
 }
 
-int main(int argc, char* argv[]){
-	Object_3D obj;
-	string filename = "";
-	string current_dir = "";
+/* A run of consecutive opaque faces of one style that --batch writes as
+   a single <path>. A face only joins when it cannot overlap any face of
+   the run, so that no face's black edges end up painted over another
+   face they used to lie under. Faces sharing a corner may touch; all
+   others keep SVG_BATCH_GAP apart. It also counts the faces that went
+   into another face's <path> and the bytes their own <path>s would have
+   taken. */
+template<typename Scalar>
+class Path_Batch{
+private:
+	const Transformed_Vertices<Scalar>& points;
+	double stroke_opacity;
+	const Face_Styles* styles;
+	Vector3i fill;
+	double fill_opacity;
+	vector<const int*> faces;
+	vector<int> corners;
+	vector<Screen_Point> low;
+	vector<Screen_Point> high;
+	size_t merged;
+	size_t saved;
 
+	Screen_Point get_bound(const int* face, int n, bool upper) const{
+		Screen_Point bound = {points.screen(0,face[0]-1), points.screen(1,face[0]-1)};
+		for(int k=1;k<n;k++){
+			double x = points.screen(0,face[k]-1), y = points.screen(1,face[k]-1);
+			bound.x = upper ? max(bound.x, x) : min(bound.x, x);
+			bound.y = upper ? max(bound.y, y) : min(bound.y, y);
+		}
+		return bound;
+	}
 
-	if (argc == 5){
-		current_dir = get_current_directory(argv[1]);
-		if(!parse_object(argv[1], obj, current_dir))
+	bool shares_corner(const int* a, int na, const int* b, int nb) const{
+		for(int j=0;j<na;j++){
+			for(int k=0;k<nb;k++){
+				if(a[j]==b[k])
+					return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	Path_Batch(const Transformed_Vertices<Scalar>& points, double stroke_opacity,
+		const Face_Styles* styles = NULL)
+		: points(points), stroke_opacity(stroke_opacity), styles(styles), merged(0), saved(0){
+	}
+
+	bool empty() const{
+		return faces.empty();
+	}
+
+	size_t getMergedFaces() const{
+		return merged;
+	}
+
+	size_t getSavedBytes() const{
+		return saved;
+	}
+
+	/* Whether the face can be added without changing the picture. */
+	bool accepts(const int* face, int n, Vector3i face_fill, double face_opacity) const{
+		if(faces.empty())
+			return true;
+		if(faces.size()>=SVG_BATCH_FACES || face_fill!=fill || face_opacity!=fill_opacity)
+			return false;
+		Screen_Point face_low = get_bound(face, n, false), face_high = get_bound(face, n, true);
+		for(size_t i=0;i<faces.size();i++){
+			double gap = shares_corner(face, n, faces[i], corners[i]) ? 0 : SVG_BATCH_GAP;
+			if(face_high.x+gap<=low[i].x || high[i].x+gap<=face_low.x ||
+				face_high.y+gap<=low[i].y || high[i].y+gap<=face_low.y)
+				continue;
+			if(!are_separated(face, n, faces[i], corners[i], points, gap))
+				return false;
+		}
+		return true;
+	}
+
+	void add(const int* face, int n, Vector3i face_fill, double face_opacity){
+		fill = face_fill;
+		fill_opacity = face_opacity;
+		faces.push_back(face);
+		corners.push_back(n);
+		low.push_back(get_bound(face, n, false));
+		high.push_back(get_bound(face, n, true));
+	}
+
+	/* Writes the run, if any, as one opaque <path> and empties it;
+	   returns the number of elements written. */
+	size_t write(Svg_File& file){
+		if(faces.empty())
 			return 0;
-		obj.setType("--face"); //Processing only face type objs
-		filename = get_filename(argv[1]);
+		file.put("<path d=\"", 9);
+		for(size_t i=0;i<faces.size();i++){
+			if(i>0)
+				file.put("Z ", 2);
+			write_SVG_outline(file, faces[i], corners[i], points);
+		}
+		size_t style_start = file.size();
+		write_SVG_style(file, fill, fill_opacity, stroke_opacity, styles);
+		// every other face would have had its own "<path d=\"" and style instead of "Z "
+		merged += faces.size()-1;
+		saved += (faces.size()-1)*(9+file.size()-style_start-2);
+		faces.clear();
+		corners.clear();
+		low.clear();
+		high.clear();
+		return 1;
 	}
-	else {
-		cout<<"usage: "<< argv[0] <<" <filename> xdeg ydeg zdeg\n";
-		return 0;
+};
+
+/* Adds the styles of the faces write_faces writes whole to `styles`,
+   and numbers them. */
+template<typename Scalar>
+void collect_face_styles(Face_Styles& styles, const vector< pair<Scalar,int> >& z_list,
+	const vector<int>& mesh_faces, const Vertex_Array<Scalar>& normals,
+	const vector<int>& face_materials, const vector<Material>& materials,
+	const Light& light, const Visible_Faces* visible = NULL){
+	for(size_t i=0;i<z_list.size();i++){
+		if(visible && visible->state[i]!=FACE_WHOLE)
+			continue;
+		int position = z_list[i].second;
+		const Material& face_material = materials[face_materials[mesh_faces[position]]];
+		Vec3<Scalar> face_norm = normals.col(position);
+		Vector3i fill = styles.getFill(get_face_color(light, face_material, face_norm));
+		styles.add(fill, face_material.get_opacity());
 	}
+	styles.sort();
+}
 
-	Vector3i fill_col (255,0,0);
-	Vector3d lighting (0,0,2);
-	lighting.normalize();
-	Light light;
-	light.set_position(lighting);
+/* Writes the culled faces in z_list order. z_list refers to positions in
+   face_ids, which pick the faces out of face_list; `mesh_faces` names
+   the mesh face each position belongs to, for its material, and
+   `normals` holds its view-space normal. With `visible`, hidden faces
+   are skipped and partly covered ones only write their visible pieces;
+   `hidden_bytes` then adds up what the skipped faces would have taken.
+   With `batch`, runs of opaque faces of one colour share a <path> where
+   the Path_Batch finds that safe, and it keeps count of what that saved. `styles` rounds the fills and may give the
+   faces classes. Returns the number of elements written. */
+template<typename Scalar>
+size_t write_faces(Svg_File& file, vector< pair<Scalar,int> >& z_list,
+	const Polygon_List& face_list, const vector<int>& face_ids, const vector<int>& mesh_faces,
+	const Transformed_Vertices<Scalar>& points, const Vertex_Array<Scalar>& normals,
+	const vector<int>& face_materials, const vector<Material>& materials,
+	const Light& light, double stroke_opacity, const Visible_Faces* visible = NULL,
+	size_t* hidden_bytes = NULL, Path_Batch<Scalar>* batch = NULL, const Face_Styles* styles = NULL){
 
-	vector< pair<string,double> > rotations = get_rotations(argv);
-	double scale = 100;
-	pair<string,double> projection = make_pair(PARALLEL,0); //set to parallel
+	Svg_File counter;
+	Path_Batch<Scalar> single(points, stroke_opacity, styles);
+	Path_Batch<Scalar>& run = batch ? *batch : single;
+	size_t elements = 0;
+	for(int i=0;i<z_list.size();i++){
+		//cout<<"Face: "<<i<<endl;
+		bool hidden = visible && visible->state[i]==FACE_HIDDEN;
+		if(hidden && !hidden_bytes)
+			continue;
+		pair<Scalar,int> face_data = z_list[i];
+		int face_no = face_ids[face_data.second];
+		const int* face = face_list.polygon(face_no);
+		int n = face_list.corners(face_no);
 
-  cout<<"Transforming vertices..."<<endl;
-	vector<Vector3d> transformed_vertices =
-  		get_transformed_vertices(obj.getVertices(),rotations,scale,projection);
-	cout<<"Vertices transformed."<<endl;
+		const Material& face_material = materials[face_materials[mesh_faces[face_data.second]]];
+		Vec3<Scalar> face_norm = normals.col(face_data.second);
+		Vector3i fill = get_face_color(light, face_material, face_norm);
+		if(styles)
+			fill = styles->getFill(fill);
+		if(hidden){
+			// hidden faces get no class, so they are counted with their style
+			write_SVG_poly(counter, face, n, points, fill, face_material.get_opacity(), stroke_opacity);
+			continue;
+		}
+		bool partial = visible && visible->state[i]==FACE_PARTIAL;
+		if(batch && !partial && face_material.get_opacity()>=1){
+			if(!run.accepts(face, n, fill, face_material.get_opacity()))
+				elements += run.write(file);
+			run.add(face, n, fill, face_material.get_opacity());
+			continue;
+		}
+		elements += run.write(file);
+		if(partial){
+			write_SVG_fragments(file, *visible, i, fill, face_material.get_opacity(), stroke_opacity);
+			elements += (visible->segment_count[i]>0) ? 2 : 1;
+		}
+		else{
+			write_SVG_poly(file, face, n, points, fill, face_material.get_opacity(), stroke_opacity, styles);
+			elements++;
+		}
+	}
+	elements += run.write(file);
+	if(hidden_bytes)
+		*hidden_bytes += counter.size();
+	return elements;
+}
 
-	vector< vector<int> > transformed_faces = obj.getFaces();
-	map<vector<int>,string>transformed_material_of_faces;
-	transformed_material_of_faces = obj.getMaterialOfFaces();
+/* Renders one view of the mesh to view.filename. Only reads `obj`, so
+   several views can be rendered at once; progress is printed when
+   `verbose` is set. */
+void render_view(const Object_3D& obj, const View& view, string title,
+	const Light& light, const Options& options, bool verbose){
+	vector< pair<string,double> > rotations = view.rotations;
+	double scale = 100;
+	Projection projection; //parallel unless a viewpoint is given
+	if(options.perspective)
+		projection = Projection(PERSPECTIVE, options.viewpoint*scale);
 
+	if(verbose)
+		cout<<"Transforming vertices..."<<endl;
+	chrono::steady_clock::time_point transform_start = chrono::steady_clock::now();
+	Transformed_Vertices<Real> transformed_vertices =
+  		get_transformed_vertices(obj.getVertices(),rotations,scale);
+	double transform_time = seconds_since(transform_start);
+	if(verbose){
+		cout<<"Vertices transformed in "<<transform_time<<" s ("
+			<<transformed_vertices.size()/transform_time/1e6<<" M vertices/s)."<<endl;
+	}
 
 	bool back_faces = false; //set to false;
 	double stroke_opacity = 1.0;
-	set_image_dimension(transformed_vertices);
+	vector<int> face_ids = get_front_faces(obj, transformed_vertices, rotations, scale,
+		projection, back_faces);
 
-	string filename_svg = filename + ".svg";
-	ofstream file;
-	file.open(filename_svg.c_str());
+	// the faces that reach emission, picked out of face_list by face_ids,
+	// and the mesh face each of them belongs to
+	const Polygon_List* face_list = &obj.getFaces();
+	vector<int> mesh_faces;
+	const Bsp_Tree& tree = obj.getBspTree();
+	bool ordered = options.bsp && !tree.empty();
+	if(ordered){
+		vector<char> visible(obj.getFaces().size(), 0);
+		for(size_t i=0;i<face_ids.size();i++)
+			visible[face_ids[i]] = 1;
+		vector<int> order;
+		get_bsp_order(tree, get_object_viewer(transformed_vertices, rotations, scale, projection),
+			visible, order);
+		face_ids.swap(order);
+		face_list = &tree.faces;
+		mesh_faces.resize(face_ids.size());
+		for(size_t i=0;i<face_ids.size();i++)
+			mesh_faces[i] = tree.sources[face_ids[i]];
+
+		// the corners the tree cut in do not move the centroid or bounds
+		Transformed_Vertices<Real> cut = get_transformed_vertices(tree.vertices, rotations, scale);
+		size_t first = transformed_vertices.size();
+		transformed_vertices.points.conservativeResize(3, first+cut.size());
+		transformed_vertices.points.rightCols(cut.size()) = cut.points;
+	}
+	else
+		mesh_faces = face_ids;
+
+	Polygon_List clipped_faces;
+	Vector3d extent = transformed_vertices.extent;
+	if(projection.isPerspective() && transformed_vertices.size()>0){
+		Real near = projection.getNearPlane();
+		Real center_z = transformed_vertices.center(2);
+		if(transformed_vertices.points.row(2).maxCoeff()-center_z > near){
+			vector<int> sources;
+			clip_faces(*face_list, face_ids, transformed_vertices, near, clipped_faces, sources);
+			face_list = &clipped_faces;
+			face_ids.resize(sources.size());
+			vector<int> clipped_mesh_faces(sources.size());
+			for(size_t i=0;i<sources.size();i++){
+				clipped_mesh_faces[i] = mesh_faces[sources[i]];
+				face_ids[i] = i;
+			}
+			mesh_faces.swap(clipped_mesh_faces);
+			if(verbose)
+				cout<<"Clipped the mesh at the near plane."<<endl;
+		}
+		extent = project_vertices(transformed_vertices, projection);
+	}
+	vector<int> dropped_ids, dropped_mesh_faces;
+	if(options.min_area>0){
+		merge_small_faces(*face_list, face_ids, mesh_faces, transformed_vertices, options.min_area,
+			dropped_ids, dropped_mesh_faces);
+	}
+	Vertex_Array<Real> normals = get_rotated_normals(obj.getFaceNormals(), mesh_faces, rotations);
+
+	if(transformed_vertices.size()>0)
+		set_image_dimension(extent);
+
+	if(options.min_area>0 && verbose){
+		Vertex_Array<Real> dropped_normals =
+			get_rotated_normals(obj.getFaceNormals(), dropped_mesh_faces, rotations);
+		Svg_File dropped;
+		for(size_t i=0;i<dropped_ids.size();i++){
+			const Material& material = obj.getMaterials()[obj.getFaceMaterials()[dropped_mesh_faces[i]]];
+			Vector3i fill = get_face_color(light, material, Vec3<Real>(dropped_normals.col(i)));
+			write_SVG_poly(dropped, face_list->polygon(dropped_ids[i]), face_list->corners(dropped_ids[i]),
+				transformed_vertices, fill, material.get_opacity(), stroke_opacity);
+		}
+		cout<<"Merged away "<<dropped_ids.size()<<" faces under "<<options.min_area
+			<<" square pixels, saving "<<dropped.size()<<" bytes."<<endl;
+	}
+
+	Svg_File file;
+	if(!file.open(view.filename, options.compress)){
+		try{
+			throw "Unable to write file ";
+		}
+		catch(char const* e){
+			cout<<e<<view.filename<<endl;
+		}
+		return;
+	}
+	bool quantized = options.precision>=0;
+	if(quantized)
+		file.setPrecision(options.precision);
 
-	write_SVG_header(file,filename);
+	write_SVG_header(file,title,quantized);
 
 	if(obj.getType() == "face"){
-		vector< vector<int> > face_list = transformed_faces;
-		map<string,Material> materials = obj.getMaterials();
-		vector< pair<double,int> >z_list;
-		cout<<"Making face list..."<<endl;
-
-		z_list = get_z_list(face_list, transformed_vertices);
-		cout<<"Face list completed. "<<face_list.size()<<" faces are present,"<<endl;
-		cout<<"And "<<transformed_vertices.size()<<" vertices are present."<<endl;
-
-		cout<<"Sorting faces..."<<endl;
-		sort(z_list.begin(),z_list.end());
-		cout<<"Faces sorted..."<<endl;
-		cout<< "Generating SVG file..."<<endl;
-		write_faces(file,z_list,face_list,transformed_vertices,
-			transformed_material_of_faces, materials, light,
-			back_faces, stroke_opacity);
+		const vector<Material>& materials = obj.getMaterials();
+		vector< pair<Real,int> >z_list;
+		if(ordered){
+			// the tree already gives the drawing order
+			z_list.resize(face_ids.size());
+			for(size_t i=0;i<face_ids.size();i++)
+				z_list[i] = make_pair((Real) 0, (int) i);
+			if(verbose){
+				cout<<"Faces ordered by the BSP tree: "<<face_ids.size()<<" fragments of "
+					<<obj.getFaces().size()<<" faces face the viewer."<<endl;
+			}
+		}
+		else{
+			if(verbose)
+				cout<<"Making face list..."<<endl;
+
+			z_list = get_z_list(*face_list, face_ids, transformed_vertices);
+			if(verbose){
+				cout<<"Face list completed. "<<face_ids.size()<<" of "<<obj.getFaces().size()
+					<<" faces face the viewer,"<<endl;
+				cout<<"And "<<transformed_vertices.size()<<" vertices are present."<<endl;
+				cout<<"Sorting faces..."<<endl;
+			}
+			if(options.bench && verbose)
+				benchmark_depth_sort(z_list);
+			sort_z_list(z_list);
+			if(verbose)
+				cout<<"Faces sorted..."<<endl;
+		}
+		Visible_Faces visible;
+		bool culled = options.hsr || options.occlusion;
+		if(culled){
+			const vector<int>& face_materials = obj.getFaceMaterials();
+			vector<char> opaque(z_list.size());
+			for(size_t i=0;i<z_list.size();i++)
+				opaque[i] = materials[face_materials[mesh_faces[z_list[i].second]]].get_opacity()>=1;
+			chrono::steady_clock::time_point hsr_start = chrono::steady_clock::now();
+			if(options.hsr){
+				visible = hide_surfaces(z_list, *face_list, face_ids, transformed_vertices, opaque);
+				if(verbose){
+					cout<<"Hidden surfaces removed in "<<seconds_since(hsr_start)<<" s: "
+						<<visible.hidden<<" of "<<z_list.size()<<" faces hidden, "
+						<<visible.partial<<" cut to "<<visible.piece_offsets.size()-1<<" pieces."<<endl;
+				}
+			}
+			else{
+				// views rendered together already keep the workers busy
+				int threads = verbose ? options.threads : 1;
+				visible = cull_occluded(z_list, *face_list, face_ids, transformed_vertices, opaque, threads);
+				if(verbose){
+					cout<<"Occlusion culling in "<<seconds_since(hsr_start)<<" s: "
+						<<visible.hidden<<" of "<<z_list.size()<<" faces hidden."<<endl;
+				}
+			}
+		}
+		if(verbose)
+			cout<< "Generating SVG file..."<<endl;
+		chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+		size_t hidden_bytes = 0;
+		size_t header_bytes = file.size();
+		long long header_savings = file.getRoundingSavings();
+		Face_Styles styles(options.color_step, options.classes, stroke_opacity);
+		if(options.classes){
+			collect_face_styles(styles, z_list, mesh_faces, normals, obj.getFaceMaterials(), materials,
+				light, culled ? &visible : NULL);
+			styles.write(file);
+		}
+		size_t style_bytes = file.size()-header_bytes;
+		Path_Batch<Real> batch(transformed_vertices, stroke_opacity, &styles);
+		size_t elements = write_faces(file,z_list,*face_list,face_ids,mesh_faces,transformed_vertices,
+			normals, obj.getFaceMaterials(), materials, light, stroke_opacity,
+			culled ? &visible : NULL, (culled && verbose) ? &hidden_bytes : NULL,
+			options.batch ? &batch : NULL, &styles);
+		size_t face_bytes = file.size()-header_bytes;
+		if(verbose){
+			double write_time = seconds_since(write_start);
+			cout<<"Faces written in "<<write_time<<" s ("<<file.size()/write_time/1e6<<" MB/s)."<<endl;
+		}
+		if(options.batch && verbose){
+			size_t single_bytes = face_bytes+batch.getSavedBytes();
+			cout<<"Batched "<<elements+batch.getMergedFaces()<<" elements into "<<elements<<", taking "
+				<<face_bytes<<" bytes instead of "<<single_bytes<<" ("
+				<<100.0*face_bytes/max(single_bytes,(size_t) 1)<<"%)."<<endl;
+		}
+		if(options.classes && verbose){
+			size_t inline_bytes = face_bytes-style_bytes+styles.getSavedBytes();
+			cout<<styles.size()<<" face styles written as classes; the faces took "<<face_bytes
+				<<" bytes instead of "<<inline_bytes<<" ("
+				<<100.0*face_bytes/max(inline_bytes,(size_t) 1)<<"%)."<<endl;
+		}
+		if(quantized && verbose){
+			long long saved = file.getRoundingSavings()-header_savings;
+			long long full_bytes = (long long) face_bytes+saved;
+			cout<<"Coordinates with "<<options.precision<<" decimals took "<<face_bytes<<" bytes instead of "
+				<<full_bytes<<", saving "<<saved<<" ("
+				<<100.0*saved/max(full_bytes,1LL)<<"%)."<<endl;
+		}
+		if(culled && verbose)
+			cout<<"Hidden faces would have taken "<<hidden_bytes<<" bytes."<<endl;
 	}
-	else{
+	else if(verbose){
 		try{
 			throw "Face Data Not Found. Ensure file contains face data.";
 		}
@@ -908,6 +5097,142 @@ int main(int argc, char* argv[]){
 
 	write_SVG_footer(file);
 	file.close();
-	cout<<"SVG file generated."<<endl;
+	if(verbose && options.compress){
+		cout<<"Compressed "<<file.size()<<" bytes of SVG to "<<file.getStoredSize()<<" ("
+			<<100.0*file.getStoredSize()/max(file.size(),(size_t) 1)<<"%)."<<endl;
+	}
+	if(verbose)
+		cout<<"SVG file generated."<<endl;
+}
+
+int main(int argc, char* argv[]){
+	Object_3D obj;
+	string filename = "";
+	string current_dir = "";
+
+
+	Options options;
+
+	if (argc >= 5 && get_options(argc, argv, options)){
+		current_dir = get_current_directory(argv[1]);
+		string cache_file = get_cache_filename(argv[1], options.merge);
+		chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+		// a budget in bytes becomes a face count: about half the faces face
+		// the viewer, each taking about get_bytes_per_face
+		size_t target_faces = options.target_faces;
+		if(options.byte_budget>0){
+			size_t budget_faces = options.byte_budget/get_bytes_per_face(options)*2;
+			target_faces = (target_faces>0) ? min(target_faces, budget_faces) : budget_faces;
+		}
+		size_t lod_faces = (target_faces>0) ? get_lod_level(target_faces) : 0;
+		string lod_file = get_lod_cache_filename(argv[1], lod_faces, options.merge);
+		bool lod_cached = lod_faces>0 && options.cache && load_mesh_cache(lod_file, argv[1], obj);
+		if(lod_cached){
+			cout<<"Loaded decimated mesh cache "<<lod_file<<endl;
+			cache_file = lod_file;
+		}
+		else{
+			bool cached = options.cache && load_mesh_cache(cache_file, argv[1], obj);
+			if(cached && obj.isMerged()!=options.merge){
+				// written before merged meshes had their own cache; start again
+				obj = Object_3D();
+				cached = false;
+			}
+			bool plain_cached = false;
+			if(!cached && options.merge && options.cache){
+				// the faces to merge can come from the plain cache, which stays as it is
+				string plain_file = get_cache_filename(argv[1]);
+				plain_cached = load_mesh_cache(plain_file, argv[1], obj) && !obj.isMerged();
+				if(plain_cached)
+					cout<<"Loaded mesh cache "<<plain_file<<endl;
+				else
+					obj = Object_3D();
+			}
+			if(cached){
+				cout<<"Loaded mesh cache "<<cache_file<<endl;
+			}
+			else if(!plain_cached){
+				if(!parse_object(argv[1], obj, current_dir, options.threads))
+					return 0;
+				obj.computeFaceNormals();
+			}
+			bool changed = !cached;
+			if(options.merge && !obj.isMerged()){
+				chrono::steady_clock::time_point merge_start = chrono::steady_clock::now();
+				size_t face_count = obj.getFaces().size();
+				merge_coplanar_faces(obj);
+				cout<<"Merged "<<face_count<<" faces into "<<obj.getFaces().size()
+					<<" coplanar polygons in "<<seconds_since(merge_start)<<" s."<<endl;
+				changed = true;
+			}
+			if(changed && options.cache && !save_mesh_cache(cache_file, argv[1], obj))
+				cout<<"Unable to write mesh cache "<<cache_file<<endl;
+
+			if(lod_faces>0 && obj.getFaces().size()>lod_faces){
+				chrono::steady_clock::time_point decimate_start = chrono::steady_clock::now();
+				size_t face_count = obj.getFaces().size();
+				Mesh_Decimator(obj).decimate(lod_faces);
+				cout<<"Decimated "<<face_count<<" faces to "<<obj.getFaces().size()<<" in "
+					<<seconds_since(decimate_start)<<" s."<<endl;
+				cache_file = lod_file;
+				if(options.cache && !save_mesh_cache(cache_file, argv[1], obj))
+					cout<<"Unable to write mesh cache "<<cache_file<<endl;
+			}
+		}
+		cout<<"Mesh loaded in "<<seconds_since(load_start)<<" s."<<endl;
+		if(options.bsp && obj.getBspTree().empty()){
+			chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+			Bsp_Tree tree;
+			Bsp_Builder(obj).build(tree);
+			cout<<"BSP tree built in "<<seconds_since(build_start)<<" s ("<<tree.nodes.size()
+				<<" nodes, "<<tree.faces.size()<<" fragments of "<<obj.getFaces().size()
+				<<" faces)."<<endl;
+			obj.setBspTree(tree);
+			if(options.cache && !save_mesh_cache(cache_file, argv[1], obj))
+				cout<<"Unable to write mesh cache "<<cache_file<<endl;
+		}
+		obj.setType("--face"); //Processing only face type objs
+		filename = get_filename(argv[1]);
+		if(options.bench)
+			benchmark_parsers(argv[1], current_dir, options.threads);
+	}
+	else {
+		print_usage(argv[0]);
+		return 0;
+	}
+
+	Vector3i fill_col (255,0,0);
+	Vector3d lighting (0,0,2);
+	lighting.normalize();
+	Light light;
+	light.set_position(lighting);
+
+	// the positional rotation is the first view
+	vector<View>& views = options.views;
+	views.insert(views.begin(), View(argv[2], argv[3], argv[4]));
+	string extension = options.compress ? ".svgz" : ".svg";
+	for(size_t i=0;i<views.size();i++){
+		if(views[i].filename.empty())
+			views[i].filename = (views.size()==1) ? filename + extension :
+				filename + "_" + views[i].label + extension;
+	}
+
+	if(views.size()==1){
+		render_view(obj, views[0], filename, light, options, true);
+	}
+	else{
+		cout<<"Rendering "<<views.size()<<" views on "<<min((int) views.size(), options.threads)
+			<<" threads..."<<endl;
+		chrono::steady_clock::time_point render_start = chrono::steady_clock::now();
+		parallel_for(views.size(), options.threads, [&](int i){
+			render_view(obj, views[i], filename, light, options, false);
+		});
+		double render_time = seconds_since(render_start);
+		for(size_t i=0;i<views.size();i++)
+			cout<<"  "<<views[i].filename<<endl;
+		cout<<views.size()<<" SVG files generated in "<<render_time<<" s ("
+			<<views.size()/render_time<<" views/s)."<<endl;
+	}
+	print_peak_memory();
 	return 0;
 }